@@ -51,5 +51,49 @@ int main()
     std::sort(std::begin(entries), std::end(entries));
     for (auto i : entries)
         std::cout << i << ", ";
+    std::cout << std::endl;
+
+    //approximate queries against brute force: min(k, size) neighbours, the j-th within (1 + epsilon) of the exact one
+    size_t wrong = 0;
+    for (size_t query = 0; query < 100; query++)
+    {
+        size_t k = 1 + query % 4;
+        auto approximate = tree.knn_query(static_cast<double>(query), k, mt::knn_approximation(0.5));
+        std::vector<double> distances;
+        for (auto i : entries)
+            distances.push_back(l2(static_cast<double>(query), i));
+        std::sort(std::begin(distances), std::end(distances));
+        if (approximate.size() != std::min(k, tree.size()))
+            wrong++;
+        for (size_t j = 0; j < approximate.size(); j++)
+        {
+            if (approximate[j].second > 1.5 * distances[j])
+                wrong++;
+        }
+    }
+    std::cout << "approximate knn mismatches: " << wrong << std::endl;
+
+    //truncated queries keep the objects found so far: a larger node budget never returns fewer neighbours and
+    //a search that ran to completion returns the exact ones
+    wrong = 0;
+    for (size_t query = 0; query < 100; query++)
+    {
+        size_t k = 1 + query % 4;
+        auto exact_result = tree.knn_query(static_cast<double>(query), k);
+        size_t previous = 0;
+        for (size_t nodes = 1; nodes < 20; nodes++)
+        {
+            bool exact = false;
+            auto truncated = tree.knn_query(static_cast<double>(query), k, mt::query_budget(0, nodes), exact);
+            if (truncated.size() < previous || truncated.size() > k)
+                wrong++;
+            if (exact && (truncated.size() != exact_result.size() ||
+                false == std::equal(std::begin(truncated), std::end(truncated), std::begin(exact_result),
+                [](const std::pair<int, double>& a, const std::pair<int, double>& b) { return a.second == b.second; })))
+                wrong++;
+            previous = truncated.size();
+        }
+    }
+    std::cout << "truncated knn mismatches: " << wrong << std::endl;
 	return 0;
 }
\ No newline at end of file
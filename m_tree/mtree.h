@@ -9,6 +9,13 @@
 #include <algorithm>
 #include <random>
 #include <map>
+#include <unordered_map>
+#include <chrono>
+#include <queue>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <tuple>
 #include "boost\variant\variant.hpp"
 #include "boost\variant\get.hpp"
 
@@ -40,6 +47,334 @@ namespace mt
     {
         BALANCED, GEN_HYPERPLANE
     };
+
+    /*
+        When the callbacks of standing range queries (subscriptions) are called.
+
+        SYNCHRONOUS: from within the insert that produced the match
+        QUEUED: matches are stored and delivered by poll_notifications
+        */
+    enum class notification_mode
+    {
+        SYNCHRONOUS, QUEUED
+    };
+
+    /*
+        Parameters for approximate nearest neighbour queries, taken from "PAC Nearest Neighbor Queries:
+        Approximate and Controlled Search in High-Dimensional and Metric Spaces" (P. Ciaccia, M. Patella).
+
+        epsilon: relative error allowed. Subtrees are pruned against dk/(1+epsilon) instead of dk so
+        each returned neighbour is at most (1+epsilon) times further away than the true one
+        delta: PAC mode, when non-zero the search stops as soon as the probability of finding a closer
+        object falls below delta. Requires a distance distribution (see estimate_distance_distribution)
+        */
+    struct knn_approximation
+    {
+        double epsilon;
+        double delta;
+
+        knn_approximation(double e = 0.0, double dl = 0.0) :epsilon(e), delta(dl)
+        {}
+    };
+
+    /*
+        Limits on the work a nearest neighbour query may do, zero means unlimited. Limits are checked
+        before each node is expanded so max_distances can be overrun by at most one node's worth (C).
+        Once a limit is reached the best neighbours found so far are returned.
+
+        max_distances: maximum number of distance computations
+        max_nodes: maximum number of nodes expanded
+        deadline: no further nodes are expanded after this point in time
+        */
+    struct query_budget
+    {
+        size_t max_distances;
+        size_t max_nodes;
+        std::chrono::steady_clock::time_point deadline;
+
+        query_budget(size_t distances = 0, size_t nodes = 0,
+            std::chrono::steady_clock::time_point end = std::chrono::steady_clock::time_point::max()) :
+            max_distances(distances), max_nodes(nodes), deadline(end)
+        {}
+    };
+
+    /*
+        Optional object held by value, the by value counterpart of a shared_ptr used by value_storage.
+        Empty holders mark free slots in a node so T must be default constructible.
+        */
+    struct emplace_tag
+    {};
+
+    template <class T>
+    class inline_value
+    {
+        T object;
+        bool engaged;
+    public:
+        inline_value() :object(), engaged(false)
+        {}
+        explicit inline_value(const T& t) :object(t), engaged(true)
+        {}
+        //constructs the object in place from the arguments of one of its constructors
+        template <class... Args>
+        inline_value(emplace_tag, Args&&... args) : object(std::forward<Args>(args)...), engaged(true)
+        {}
+
+        explicit operator bool() const
+        {
+            return engaged;
+        }
+        const T& operator*() const
+        {
+            return object;
+        }
+        const T* operator->() const
+        {
+            return &object;
+        }
+        const T* get() const
+        {
+            return engaged ? &object : nullptr;
+        }
+        void reset()
+        {
+            object = T();
+            engaged = false;
+        }
+    };
+
+    /*
+        Storage policies for the objects in the tree, chosen by the last template argument of m_tree.
+
+        shared_storage: every object is a separate allocation shared with the caller, routing objects
+        share the object they were promoted from
+        value_storage: objects are copied into the leaves and every routing object holds its own copy
+        of its value, nothing is shared and traversal does not chase pointers. Best for small T
+        */
+    struct shared_storage
+    {
+        template <class T>
+        struct holder
+        {
+            typedef std::shared_ptr<T> type;
+        };
+
+        template <class T>
+        static std::shared_ptr<T> hold(const std::shared_ptr<T>& t)
+        {
+            return t;
+        }
+
+        template <class T, class... Args>
+        static std::shared_ptr<T> emplace(Args&&... args)
+        {
+            return std::make_shared<T>(std::forward<Args>(args)...);
+        }
+    };
+
+    struct value_storage
+    {
+        template <class T>
+        struct holder
+        {
+            typedef inline_value<T> type;
+        };
+
+        template <class T>
+        static inline_value<T> hold(const std::shared_ptr<T>& t)
+        {
+            return inline_value<T>(*t);
+        }
+
+        template <class T, class... Args>
+        static inline_value<T> emplace(Args&&... args)
+        {
+            return inline_value<T>(emplace_tag(), std::forward<Args>(args)...);
+        }
+    };
+
+    /*
+        Rows of a fixed number of elements in one contiguous buffer, for trees that index objects by their
+        offset (row number) in the store instead of holding the objects. Used as
+
+            contiguous_store<float> store(128);
+            m_tree<size_t, C, float, ID, value_storage> tree(store.metric<float>(distance_on_views));
+            tree.insert(id, store.append(row));
+
+        so leaves hold the offsets inline and the distance function is given views of the rows. The store
+        either owns its rows or borrows an existing buffer (e.g. a matrix the caller keeps or a mapped file),
+        borrowed stores are read only. The store must outlive the trees using its metric.
+
+        Rows are kept in the order they were appended, relayout rewrites them in the leaf order of a tree.
+        */
+    template <class E>
+    class contiguous_store
+    {
+    public:
+        typedef size_t offset;
+
+        //a row of the store, valid until rows are appended or the store is replaced
+        struct view
+        {
+            const E* data;
+            size_t size;
+
+            const E& operator[](size_t i) const
+            {
+                return data[i];
+            }
+            const E* begin() const
+            {
+                return data;
+            }
+            const E* end() const
+            {
+                return data + size;
+            }
+        };
+
+        explicit contiguous_store(size_t dimension);
+        //takes over a row major matrix, its size must be a multiple of dimension
+        contiguous_store(size_t dimension, std::vector<E>&& matrix);
+        //borrows count rows starting at data without copying them
+        contiguous_store(size_t dimension, const E* data, size_t count);
+
+        size_t dimension() const;
+        size_t size() const;
+        bool borrowed() const;
+
+        //copies dimension() elements from row to the end of the store and returns their offset
+        offset append(const E* row);
+        view row(offset o) const;
+
+        //distance function over offsets calling d on the views of the rows
+        template <typename R>
+        std::function<R(const offset&, const offset&)> metric(std::function<R(const view&, const view&)> d) const;
+        //distance from a view (e.g. of a query outside the store) to a row, for the range and knn queries of a tree
+        template <typename R>
+        std::function<R(const view&, const offset&)> query_metric(std::function<R(const view&, const view&)> d) const;
+
+        /*
+            Rewrites the store so the objects of each leaf of tree, and of each subtree, are contiguous and
+            updates the offsets held by the tree. Rows the tree does not reference (deleted objects, queries)
+            are dropped and their offsets become invalid, so tree must be the only user of the store.
+            The relaid out rows are owned by the store
+            */
+        template <class Tree>
+        void relayout(Tree& tree);
+
+    private:
+        size_t dim;
+        size_t rows;
+        const E* base;
+        std::vector<E> elements;
+    };
+
+    template <class E>
+    contiguous_store<E>::contiguous_store(size_t dimension) :dim(dimension), rows(0), base(nullptr)
+    {
+        BOOST_ASSERT_MSG(dimension > 0, "contiguous_store: rows need at least one element");
+    }
+
+    template <class E>
+    contiguous_store<E>::contiguous_store(size_t dimension, std::vector<E>&& matrix) :
+        dim(dimension), rows(0), base(nullptr), elements(std::move(matrix))
+    {
+        BOOST_ASSERT_MSG(dimension > 0, "contiguous_store: rows need at least one element");
+        BOOST_ASSERT_MSG(0 == elements.size() % dimension, "contiguous_store: partial row");
+        rows = elements.size() / dimension;
+        base = elements.data();
+    }
+
+    template <class E>
+    contiguous_store<E>::contiguous_store(size_t dimension, const E* data, size_t count) :
+        dim(dimension), rows(count), base(data)
+    {
+        BOOST_ASSERT_MSG(dimension > 0, "contiguous_store: rows need at least one element");
+    }
+
+    template <class E>
+    size_t contiguous_store<E>::dimension() const
+    {
+        return dim;
+    }
+
+    template <class E>
+    size_t contiguous_store<E>::size() const
+    {
+        return rows;
+    }
+
+    template <class E>
+    bool contiguous_store<E>::borrowed() const
+    {
+        return rows > 0 && elements.empty();
+    }
+
+    template <class E>
+    typename contiguous_store<E>::offset contiguous_store<E>::append(const E* row)
+    {
+        BOOST_ASSERT_MSG(false == borrowed(), "contiguous_store: borrowed rows are read only");
+        elements.insert(std::end(elements), row, row + dim);
+        base = elements.data();
+        return rows++;
+    }
+
+    template <class E>
+    typename contiguous_store<E>::view contiguous_store<E>::row(offset o) const
+    {
+        BOOST_ASSERT_MSG(o < rows, "contiguous_store: offset out of range");
+        view v;
+        v.data = base + o * dim;
+        v.size = dim;
+        return v;
+    }
+
+    template <class E>
+    template <typename R>
+    std::function<R(const typename contiguous_store<E>::offset&, const typename contiguous_store<E>::offset&)>
+        contiguous_store<E>::metric(std::function<R(const view&, const view&)> d) const
+    {
+        const contiguous_store* store = this;
+        return [store, d](const offset& a, const offset& b){
+            return d(store->row(a), store->row(b));
+        };
+    }
+
+    template <class E>
+    template <typename R>
+    std::function<R(const typename contiguous_store<E>::view&, const typename contiguous_store<E>::offset&)>
+        contiguous_store<E>::query_metric(std::function<R(const view&, const view&)> d) const
+    {
+        const contiguous_store* store = this;
+        return [store, d](const view& q, const offset& o){
+            return d(q, store->row(o));
+        };
+    }
+
+    template <class E>
+    template <class Tree>
+    void contiguous_store<E>::relayout(Tree& tree)
+    {
+        std::vector<E> laid_out;
+        laid_out.reserve(rows * dim);
+        //offsets already moved, an object is held by its leaf and possibly by routing objects
+        std::unordered_map<offset, offset> moved;
+        tree.relocate([&](const offset& o){
+            auto it = moved.find(o);
+            if (it != moved.end())
+                return it->second;
+            view v = row(o);
+            laid_out.insert(std::end(laid_out), v.begin(), v.end());
+            offset relocated = moved.size();
+            moved[o] = relocated;
+            return relocated;
+        });
+        elements.swap(laid_out);
+        rows = moved.size();
+        base = elements.data();
+    }
+
     /*
         An M-Tree is a tree that partions elements in metric space so as to minimise the distance between them.
 
@@ -53,8 +388,9 @@ namespace mt
         C: capacity of a node: how many values it can hold
         R: what the distance function returns
         ID: type for the reference values ID
+        V: how the objects are stored, shared_storage or value_storage
         */
-    template < class T, size_t C = 3, typename R = double, typename ID = int >
+    template < class T, size_t C = 3, typename R = double, typename ID = int, typename V = shared_storage >
     class m_tree
     {
         ////////////////////////////////////////////////////////////////////////////
@@ -73,6 +409,11 @@ namespace mt
         typedef std::vector<boost::variant<leaf_object, routing_object>> data_vector;
         typedef std::function<R(const T&, const T&)> distance_function;
         typedef std::function<void(const data_vector&, routing_object& o1, routing_object& o2)> partition_function;
+        //distances from an object being inserted to routing objects, keyed by the routing object's value
+        typedef std::map<const T*, R> distance_cache;
+        typedef std::chrono::steady_clock::time_point time_point;
+        //what leaf and routing objects hold their value in, see shared_storage and value_storage
+        typedef typename V::template holder<T>::type value_holder;
 
         struct get_subtrees :public boost::static_visitor<>
         {
@@ -98,20 +439,6 @@ namespace mt
             
         };
 
-        struct get_parent_value :public boost::static_visitor<std::shared_ptr<T>>
-        {
-            template<class X>
-            std::shared_ptr<T> operator()(X t)
-            {
-                for (int i = 0; i < C; i++)
-                {
-                    if (t[i].value.use_count()>0 && t[i].distance == 0)
-                        return t[i].reference_value();
-                }
-                return std::shared_ptr<T>();
-            }
-        };
-
         //Gets data entries in the form of an array of routing or leaf objects
         struct get_data_entries :public boost::static_visitor<>
         {
@@ -129,40 +456,27 @@ namespace mt
             {
                 for (size_t i = 0; i < a; i++)
                 {
-                    if (t[i].value.use_count()>0 )
+                    if (t[i].value)
                         data.push_back(t[i]);
                 }
             }
         };
 
-        struct get_node_value :public boost::static_visitor < std::shared_ptr<T>>
+        struct get_node_value :public boost::static_visitor <const T*>
         {
             template<class X>
-            std::shared_ptr<T> operator()(X t)
+            const T* operator()(const X& t) const
             {
-                return t.reference_value();
+                return t.value.get();
             }
         };
 
-        /*
-        * gets the list of reference objects in the node for routing or leaf objects
-        */
-        struct get_object_values :public boost::static_visitor<>
+        struct get_node_holder :public boost::static_visitor <value_holder>
         {
-            std::vector<std::weak_ptr<T>>& values;
-            get_object_values(std::vector<std::weak_ptr<T>>& v) :values(v)
-            {	}
-
-            template<typename X>
-            void operator ()(X x)
+            template<class X>
+            value_holder operator()(const X& t) const
             {
-                for (size_t i = 0; i < x.size(); i++)
-                {
-                    if (x[i].value.use_count() > 0)
-                    {
-                        values.push_back(x[i].value);
-                    }
-                }
+                return t.value;
             }
         };
 
@@ -173,15 +487,15 @@ namespace mt
             update_parent(distance_function dist_func) :d(dist_func){}
             
             template<class X>
-            void operator()(X x, route_set& routers)
+            void operator()(const X& x, route_set& routers)
             {
                 for (routing_object& r : routers)
                 {
                     if (r.covering_tree)
                     {
-                        if (auto lock = r.value.lock())
+                        if (r.value)
                         {
-                            r.distance = d(*lock, *x.reference_value());
+                            r.distance = d(*r.value, *x.reference_value());
                         }
                         r.covering_tree->parent = parent;
                     }
@@ -203,7 +517,7 @@ namespace mt
             {
                 for (size_t i = 0; i < C; i++)
                 {
-                    if (set[i].value.use_count() == 0)
+                    if (!set[i].value)
                     {
                         set[i] = x;
                         set[i].distance = distance;
@@ -220,6 +534,56 @@ namespace mt
         };
         
 
+        struct get_object_count :public boost::static_visitor<size_t>
+        {
+            size_t operator()(const route_set& routers) const
+            {
+                size_t result = 0;
+                for (const routing_object& ro : routers)
+                {
+                    if (ro.covering_tree)
+                        result += ro.count;
+                }
+                return result;
+            }
+
+            size_t operator()(const leaf_set& leaves) const
+            {
+                size_t result = 0;
+                for (const leaf_object& lo : leaves)
+                {
+                    if (lo.value)
+                        result++;
+                }
+                return result;
+            }
+        };
+
+        struct get_newest_timestamp :public boost::static_visitor<time_point>
+        {
+            time_point operator()(const route_set& routers) const
+            {
+                time_point result = time_point::min();
+                for (const routing_object& ro : routers)
+                {
+                    if (ro.covering_tree)
+                        result = std::max(result, ro.newest);
+                }
+                return result;
+            }
+
+            time_point operator()(const leaf_set& leaves) const
+            {
+                time_point result = time_point::min();
+                for (const leaf_object& lo : leaves)
+                {
+                    if (lo.value)
+                        result = std::max(result, lo.timestamp);
+                }
+                return result;
+            }
+        };
+
         struct get_covering_radius :public boost::static_visitor<R>
         {
             R operator()(route_set& routers)
@@ -268,42 +632,225 @@ namespace mt
         *	covering_radius: radius of sphere centred on reference value, all values in the covering
         *	tree are within this sphere
         *	distance: distance from parent object
+        *	count: number of objects in the covering tree
+        *	newest: latest timestamp of the objects in the covering tree
+        *	deleted: objects deleted from the covering tree since it was built, drives compaction
+        *
+        *	The routing object shares ownership of (or with value_storage holds a copy of) its value so it
+        *	stays usable after the object it was promoted from has expired.
         */
         struct routing_object
         {
-            std::weak_ptr<T> value;
+            value_holder value;
             std::shared_ptr<tree_node> covering_tree;
             R covering_radius;
             R distance;
+            size_t count;
+            time_point newest;
+            size_t deleted;
 
-            routing_object() :covering_radius(static_cast<R>(0)), distance(static_cast<R>(0))
+            routing_object() :covering_radius(static_cast<R>(0)), distance(static_cast<R>(0)), count(0), deleted(0)
             {}
 
-            std::shared_ptr<T> reference_value()
+            const value_holder& reference_value() const
             {
-                return value.lock();
+                return value;
             }
         };
 
         /*
-        * Data contained in leaf node, owning pointer to the reference value and the object id
-        * as well as the distance from the parent centre
+        * Data contained in leaf node, the (owned or shared) reference value and the object id
+        * as well as the distance from the parent centre and the time the object was inserted
         */
         struct leaf_object
         {
-            std::shared_ptr<T> value;
+            value_holder value;
             ID id;
             R distance;
+            time_point timestamp;
             leaf_object() :distance(static_cast<R>(0))
             {}
-            std::shared_ptr<T> reference_value()
+            const value_holder& reference_value() const
             {
                 return value;
             }
         };
 
+        /*
+        * Node waiting to be expanded by a nearest neighbour search. dmin is a lower bound on the distance
+        * from the query to anything in the node and parent_distance the distance from the query to the
+        * routing object of the node, kept so it never has to be recomputed
+        */
+        struct knn_entry
+        {
+            R dmin;
+            R parent_distance;
+            std::weak_ptr<tree_node> node;
+            knn_entry() :dmin(static_cast<R>(0)), parent_distance(static_cast<R>(0))
+            {}
+        };
+
+        /*
+        * Node waiting to be expanded by a farthest neighbour search, dmax is an upper bound on the distance
+        * from the query to anything in the node
+        */
+        struct farthest_entry
+        {
+            R dmax;
+            R parent_distance;
+            std::weak_ptr<tree_node> node;
+            farthest_entry() :dmax(static_cast<R>(0)), parent_distance(static_cast<R>(0))
+            {}
+            bool operator<(const farthest_entry& other) const
+            {
+                return dmax < other.dmax;
+            }
+        };
+
+        /*
+        * Node waiting to be expanded by a complex query, dmin is a lower bound on the score of anything
+        * in the node and parent_distances the distances from each query object to its routing object
+        */
+        struct complex_entry
+        {
+            R dmin;
+            std::vector<R> parent_distances;
+            std::weak_ptr<tree_node> node;
+            complex_entry() :dmin(static_cast<R>(0))
+            {}
+        };
+
+        /*
+        * Entry in the list of nearest neighbours. Either an object or, while subtree is set, an upper
+        * bound (dmax) standing in for an object of a subtree that has not been expanded yet
+        */
+        struct nn_entry
+        {
+            ID id;
+            R distance;
+            const tree_node* subtree;
+            nn_entry() :id(), distance(static_cast<R>(0)), subtree(nullptr)
+            {}
+        };
+
+        /*
+        * One side of a pair of subtrees visited by a join: the node, the value of the routing object
+        * pointing to it and its covering radius. The root has no routing object so no center
+        */
+        struct join_side
+        {
+            std::shared_ptr<tree_node> node;
+            const T* center;
+            R radius;
+            join_side() :center(nullptr), radius(std::numeric_limits<R>::max())
+            {}
+        };
+
+        /*
+        * Pair of subtrees still to be joined. center_distance is the distance between the two centers
+        * when both exist, self is set when a subtree is joined with itself
+        */
+        struct join_task
+        {
+            join_side a;
+            join_side b;
+            R center_distance;
+            bool self;
+            join_task() :center_distance(static_cast<R>(0)), self(false)
+            {}
+        };
+
 
     public:
+        /*
+        * Incremental nearest neighbour search, taken from "Distance Browsing in Spatial Databases"
+        * (G. R. Hjaltason, H. Samet). Objects come out one at a time in increasing distance from the
+        * query and the priority queue is kept between calls, so each call only does the work needed to
+        * find the next object. Objects and routing objects are queued with the lower bound given by their
+        * distance to the parent, the real distance is only computed once they reach the front of the queue.
+        *
+        * The browser refers to the tree, which must not be modified or destroyed while browsing.
+        */
+        class nn_browser
+        {
+        public:
+            //gets the next closest object, false once every object has been returned
+            bool next(std::pair<ID, R>& result);
+            bool empty() const;
+
+        private:
+            friend class m_tree;
+
+            struct browse_entry
+            {
+                R key;
+                R parent_distance;
+                std::weak_ptr<tree_node> node;
+                const routing_object* router;
+                const leaf_object* object;
+                bool exact;
+                browse_entry() :key(static_cast<R>(0)), parent_distance(static_cast<R>(0)), router(nullptr), object(nullptr),
+                    exact(false)
+                {}
+            };
+
+            //objects come before nodes on ties, entries with a known distance before ones with a bound
+            struct browse_order
+            {
+                bool operator()(const browse_entry& a, const browse_entry& b) const
+                {
+                    if (a.key != b.key)
+                        return a.key > b.key;
+                    return rank(a) > rank(b);
+                }
+                static int rank(const browse_entry& e)
+                {
+                    return (e.object ? 0 : 2) + (e.exact ? 0 : 1);
+                }
+            };
+
+            nn_browser(const m_tree& t, const T& r);
+            void expand(const browse_entry& entry);
+
+            const m_tree* tree;
+            T ref;
+            std::priority_queue<browse_entry, std::vector<browse_entry>, browse_order> queue;
+        };
+
+        //predicate on object ids used to filter query results
+        typedef std::function<bool(const ID&)> id_filter;
+        //receives the ids of a pair of objects and their distance
+        typedef std::function<void(const ID&, const ID&, R)> pair_callback;
+        /*
+        * Combines the distances from an object to each query object of a complex query into one score.
+        * Must be monotone: not decreasing when any one distance grows
+        */
+        typedef std::function<R(const std::vector<R>&)> scoring_function;
+        //called with the id of a newly inserted object and its distance to the subscribed query object
+        typedef std::function<void(const ID&, R)> notify_callback;
+        //distance from a query object of type Q to a stored object. Named through a nested type so Q is
+        //deduced from the query object alone and lambdas convert without naming Q
+        template <class Q>
+        struct query_distance_function
+        {
+            typedef std::function<R(const Q&, const T&)> type;
+        };
+        //hash of an object's contents, equal objects must hash equal
+        typedef std::function<size_t(const T&)> hash_function;
+
+        /*
+        * Neighbour lists in compressed sparse row form. The neighbours of ids[i] are
+        * neighbours[offsets[i]] up to (not including) neighbours[offsets[i + 1]], closest first, with their
+        * distances at the same positions in distances
+        */
+        struct knn_graph
+        {
+            std::vector<ID> ids;
+            std::vector<size_t> offsets;
+            std::vector<ID> neighbours;
+            std::vector<R> distances;
+        };
+
         //Constructors and destructors 
         m_tree(distance_function dist_func = distance_function());
         ~m_tree();
@@ -311,17 +858,121 @@ namespace mt
         void set_distance_function(distance_function dist_func);
         void set_split_policy(split_policy policy);
         void set_partition_algorithm(partition_algorithm algorithm);
+        void set_notification_mode(notification_mode mode);
+        //indexes every object by hash for contains/find, an empty function removes the index
+        void set_hash_function(hash_function hasher);
 
         size_t size() const;
         double fat_factor() const;
         bool empty() const;
 
         void insert(ID id, std::shared_ptr<T> t);
+        //insert with an explicit timestamp (e.g. the event time) instead of the time of insertion
+        void insert(ID id, std::shared_ptr<T> t, time_point stamp);
+        //insert by value, t is moved into the tree. With value_storage nothing is allocated for the object
+        void insert(ID id, T&& t);
+        void insert(ID id, T&& t, time_point stamp);
+        //constructs the object from args directly in the storage of the tree
+        template <class... Args>
+        void emplace(ID id, Args&&... args);
+        //emplace with an explicit timestamp, named apart so a time_point can still be a constructor argument
+        template <class... Args>
+        void emplace_stamped(ID id, time_point stamp, Args&&... args);
+        //removes every object stamped before the given time, returns how many were removed
+        size_t expire(time_point before);
+        //deletes every object whose id matches predicate, returns how many were deleted. Subtrees left
+        //with more than the compaction threshold (a fraction) of their objects deleted are rebuilt, one per
+        //following insert or all at once by compact
+        size_t delete_where(const id_filter& predicate);
+        //exact match lookups, objects o with d(obj, o) == 0. Hash lookups with a hash function set, a tree
+        //search otherwise. find returns the id of a match and true, or false when there is none
+        bool contains(const T& obj) const;
+        std::pair<ID, bool> find(const T& obj) const;
+        void compact();
+        void set_compaction_threshold(double threshold);
+        //replaces every stored object o by relocation(o). Leaf objects are visited first, a leaf at a time in
+        //depth first order, then routing objects. Used to move objects held by reference (see contiguous_store)
+        void relocate(const std::function<T(const T&)>& relocation);
+        //inserts t unless an object within eps of it is already stored. Returns the id of that object and
+        //false, or id and true when t was inserted
+        std::pair<ID, bool> insert_if_no_neighbor(ID id, std::shared_ptr<T> t, R eps);
         void clear();
 
+        //standing range queries: callback is notified of every object inserted within radius of query from
+        //now on. Returns a handle for unsubscribe
+        size_t subscribe(const T& query, R radius, const notify_callback& callback);
+        void unsubscribe(size_t handle);
+        //delivers the notifications queued in QUEUED mode, returns how many were delivered
+        size_t poll_notifications();
+
         //range and nearest neighbour searches
         std::vector<ID> range_query(const T& ref, R range);
         std::vector<std::pair<ID, R>> knn_query(const T& ref, size_t k);
+        //only objects whose id passes filter are considered, it is checked before any distance is computed
+        std::vector<ID> range_query(const T& ref, R range, const id_filter& filter);
+        std::vector<std::pair<ID, R>> knn_query(const T& ref, size_t k, const id_filter& filter);
+        //only objects stamped at or after since are considered, older subtrees are skipped whole
+        std::vector<ID> range_query(const T& ref, R range, time_point since);
+        std::vector<std::pair<ID, R>> knn_query(const T& ref, size_t k, time_point since);
+        //queries with an object of another type Q (e.g. a view of an object held elsewhere), so no T has to be built.
+        //query_distance(q, o) must equal the distance from o to the object q stands for
+        template <class Q>
+        std::vector<ID> range_query(const Q& ref, R range, const typename query_distance_function<Q>::type& query_distance);
+        template <class Q>
+        std::vector<std::pair<ID, R>> knn_query(const Q& ref, size_t k,
+            const typename query_distance_function<Q>::type& query_distance);
+        //at most k neighbours, none of them further than range from ref
+        std::vector<std::pair<ID, R>> knn_range_query(const T& ref, size_t k, R range);
+        //objects o with inner <= d(ref, o) <= outer
+        std::vector<ID> ring_query(const T& ref, R inner, R outer);
+        //the k objects farthest from ref, farthest first
+        std::vector<std::pair<ID, R>> farthest_query(const T& ref, size_t k) const;
+        //the k closest pairs (a from this tree, b from other), closest first. When other is this tree each
+        //unordered pair of distinct objects is considered once
+        std::vector<std::tuple<ID, ID, R>> closest_pairs(const m_tree& other, size_t k) const;
+        //DBSCAN clustering, objects with at least min_pts objects (themselves included) within eps are core
+        //objects. Returns the cluster of every id numbered from 0, noise is labelled -1
+        std::map<ID, int> dbscan(R eps, size_t min_pts, size_t threads = 1) const;
+        //the n objects farthest from their k-th nearest neighbour, with that distance, most isolated first.
+        //Empty when the tree holds k objects or fewer
+        std::vector<std::pair<ID, R>> knn_outliers(size_t k, size_t n, size_t threads = 1) const;
+        //the k objects with the lowest score over their distances to all of refs, lowest first
+        std::vector<std::pair<ID, R>> complex_query(const std::vector<T>& refs, size_t k, const scoring_function& score) const;
+        //common monotone scoring functions: "close to any", "close to all" and a weighted sum
+        static scoring_function min_score();
+        static scoring_function max_score();
+        static scoring_function weighted_sum(const std::vector<R>& weights);
+        //number of objects range_query would return
+        size_t range_count(const T& ref, R range);
+
+        //uniform random samples (with replacement) of the ids in the tree or within range of ref
+        std::vector<ID> sample(size_t n);
+        std::vector<ID> sample_in_range(const T& ref, R range, size_t n);
+
+        //similarity joins, every pair of objects (a from this tree, b from other) with d(a, b) <= range is
+        //passed to callback. self_join reports each unordered pair of this tree once. With threads > 1
+        //pairs of subtrees are joined in parallel and callback must be thread safe
+        void similarity_join(const m_tree& other, R range, const pair_callback& callback, size_t threads = 1) const;
+        void self_join(R range, const pair_callback& callback, size_t threads = 1) const;
+
+        //k nearest neighbours of every object in the tree (excluding the object itself), leaves are
+        //processed in parallel when threads > 1
+        knn_graph all_knn(size_t k, size_t threads = 1) const;
+        //k nearest neighbours in reference of every object in this tree, each leaf of this tree shares
+        //one traversal of reference. Leaves are processed in parallel when threads > 1
+        knn_graph knn_join(const m_tree& reference, size_t k, size_t threads = 1) const;
+
+        std::vector<std::pair<ID, R>> knn_query(const T& ref, size_t k, const knn_approximation& approx);
+        //anytime queries, exact is set to false if the budget ran out before the result was proven
+        std::vector<std::pair<ID, R>> knn_query(const T& ref, size_t k, const query_budget& budget, bool& exact);
+        std::vector<std::pair<ID, R>> knn_query(const T& ref, size_t k, const knn_approximation& approx,
+            const query_budget& budget, bool& exact);
+
+        //objects in increasing distance from ref, computed lazily
+        nn_browser browse(const T& ref) const;
+
+        //samples the distance between random pairs of objects, used by the PAC mode of knn_query
+        void estimate_distance_distribution(size_t samples);
 
         //Here for debugging purposes
         void print(print_level level = SPARSE, std::weak_ptr<tree_node> print_node = std::weak_ptr<tree_node>());
@@ -332,21 +983,89 @@ namespace mt
         size_t depth(std::weak_ptr<tree_node> node) const;
 
         void update_covering_radius(std::weak_ptr<tree_node> parent);
+        //value of the routing object pointing to node, null for the root
+        const T* routing_value(std::shared_ptr<tree_node> node) const;
         
-        //Functions used by the knn_query
-        void knn_node_search(const T& ref, std::shared_ptr<tree_node> current, size_t k,
-            std::vector<std::pair<R, std::weak_ptr<tree_node>>>& queue, std::vector<std::pair<ID, R>>& result);
-        void nn_list_update(const std::pair<ID, R>& in, size_t k, std::vector<std::pair<ID, R>>& result);
+        //Functions used by the knn_query, query_distance is d for queries of type T. range_search
+        //appends the distance of each result to distances unless it is null
+        template <class Q>
+        std::vector<ID> range_search(const Q& ref, R range, const id_filter& filter, time_point since,
+            const std::function<R(const Q&, const T&)>& query_distance, std::vector<R>* distances);
+        template <class Q>
+        std::vector<std::pair<ID, R>> knn_search(const Q& ref, size_t k, R range, const knn_approximation& approx,
+            const query_budget& budget, const id_filter& filter, time_point since, bool& exact,
+            const std::function<R(const Q&, const T&)>& query_distance) const;
+        template <class Q>
+        void knn_node_search(const Q& ref, const knn_entry& current, size_t k, R range, double epsilon,
+            const id_filter& filter, time_point since, std::vector<knn_entry>& queue, std::vector<nn_entry>& result,
+            std::vector<nn_entry>* seen, size_t& distances, const std::function<R(const Q&, const T&)>& query_distance) const;
+        void nn_list_update(const nn_entry& in, size_t k, std::vector<nn_entry>& result) const;
+        R nn_bound(const std::vector<nn_entry>& result, size_t k, R range) const;
+        R relax_bound(R dk, double epsilon) const;
+        R pac_radius(double delta, size_t k) const;
+
+        void collect_objects(std::vector<const T*>& objects) const;
+        void collect_leaves(std::shared_ptr<tree_node> node, std::vector<std::shared_ptr<tree_node>>& leaves) const;
+
+        //Functions used by the all_knn and knn_join, queries are grouped by leaf of this tree
+        knn_graph knn_leaves(const m_tree& reference, size_t k, bool exclude_self, size_t threads) const;
+        const T* leaf_queries(std::shared_ptr<tree_node> leaf, std::vector<const leaf_object*>& queries,
+            std::vector<R>& center_distances) const;
+        void knn_batch(const std::vector<const leaf_object*>& queries, const T& center, const std::vector<R>& center_distances,
+            size_t k, bool exclude_self, R cutoff, std::vector<std::vector<nn_entry>>& results) const;
+        knn_graph make_knn_graph(std::vector<ID>& ids, const std::vector<std::vector<nn_entry>>& rows) const;
+        //uniformly chosen object of the subtree, descends proportionally to the subtree counts
+        ID sample_subtree(std::shared_ptr<tree_node> node);
+
+        //Bounds the score of an entry, computing its distances to the query objects only while needed
+        bool complex_score(const std::vector<T>& refs, const scoring_function& score, const T& value,
+            std::vector<R>& distances, R radius, R threshold, R& result) const;
+
+        //Functions used by the joins, a filter returning false drops a pair of subtrees unvisited
+        typedef std::function<bool(const join_task&)> join_filter;
+        void join(const join_task& start, R range, const pair_callback& callback, size_t threads,
+            const join_filter& filter = join_filter()) const;
+        void join_step(const join_task& task, R range, const pair_callback& callback, std::vector<join_task>& pending,
+            const join_filter& filter) const;
+        void join_leaves(const join_task& task, R range, const pair_callback& callback) const;
+
+        //lock free union-find used by the clustering, sets are merged into their smallest member
+        static size_t find_set(std::vector<std::atomic<size_t>>& sets, size_t x);
+        static void unite_sets(std::vector<std::atomic<size_t>>& sets, size_t a, size_t b);
         
         //insert functions, used to break up functionality or abstract away the implementation
-        void insert(ID id, std::weak_ptr<T> t, std::weak_ptr<tree_node> node);
-        void internal_node_insert(ID id, std::weak_ptr<T> t, std::weak_ptr<tree_node> N);
-        void leaf_node_insert(ID id, std::weak_ptr<T> t, std::weak_ptr<tree_node> lo);
+        //adds a new object: inserts it, indexes it, notifies subscribers and runs a compaction step
+        void insert_object(ID id, value_holder&& held, const distance_cache& known, time_point stamp);
+        //the holder is moved down the tree into the leaf that keeps it
+        void insert(ID id, value_holder&& t, std::weak_ptr<tree_node> node, const distance_cache& known, time_point stamp);
+        void internal_node_insert(ID id, value_holder&& t, std::weak_ptr<tree_node> N, const distance_cache& known,
+            time_point stamp);
+        void leaf_node_insert(ID id, value_holder&& t, std::weak_ptr<tree_node> lo, const distance_cache& known,
+            time_point stamp);
+        R cached_distance(const T& t, const T& router, const distance_cache& known) const;
+        void notify_subscribers(const ID& id, const T& value);
+        void hash_object(const ID& id, const T& value, time_point stamp, std::weak_ptr<tree_node> leaf);
+        //points the hash entry of an object, or of every object of a leaf, at the leaf holding it
+        void locate_object(const leaf_object& lo, std::shared_ptr<tree_node> leaf);
+        void locate_objects(std::shared_ptr<tree_node> leaf);
+        //removes the expired objects of a subtree, returns how many were removed
+        size_t expire_node(std::shared_ptr<tree_node> node, time_point before);
+        //replaces a root left with a single routing object by its subtree, or with none by an empty leaf
+        void shrink_root();
+        size_t delete_node(std::shared_ptr<tree_node> node, const id_filter& predicate);
+        //reinserts the objects of a subtree queued for compaction
+        void compact_node(std::shared_ptr<tree_node> node);
+        bool find_neighbor(const T& t, R eps, ID& found, distance_cache& known) const;
+        //rounding error of a triangle bound built from a and b. An object on the rim of a ball can miss an
+        //exact bound by it, which matters to searches for equal objects
+        static R rounding_slack(R a, R b);
 
         //split promote and partition functions
         void split(boost::variant<leaf_object, routing_object>& obj, std::weak_ptr<tree_node> n);
         void promote(const std::vector<boost::variant<leaf_object, routing_object>>& objects, routing_object& o1, routing_object& o2);
-        void partition(const data_vector& o, routing_object& n1, routing_object& n2, std::vector<R> distances = std::vector<R>());
+        //partitions o around the objects at n1_index and n2_index, which become the values of n1 and n2
+        void partition(const data_vector& o, size_t n1_index, size_t n2_index, routing_object& n1, routing_object& n2,
+            std::vector<R> distances = std::vector<R>());
 
         //specific promotion strategies
         void maximise_distance_lower_bound(const data_vector& objects, routing_object& o1, routing_object& o2);
@@ -354,32 +1073,123 @@ namespace mt
         void minimise_max_radius(const data_vector& objects, routing_object& o1, routing_object& o2);
         void random(const data_vector& objects, routing_object& o1, routing_object& o2);
         void sampling(const data_vector& objects, routing_object& o1, routing_object& o2);
+        void random_indices(const data_vector& objects, size_t& n1_index, size_t& n2_index);
 
         //specific partitioning algorithms
-        void balanced_partition(const data_vector& o, std::vector<R> distances, routing_object& n1, routing_object& n2);
-        void generalised_partition(const data_vector& o, std::vector<R> distances, routing_object& n1, routing_object& n2);
+        void balanced_partition(const data_vector& o, std::vector<R> distances, size_t n1_index, size_t n2_index,
+            routing_object& n1, routing_object& n2);
+        void generalised_partition(const data_vector& o, std::vector<R> distances, size_t n1_index, size_t n2_index,
+            routing_object& n1, routing_object& n2);
 
         void calculate_distance_matrix(const data_vector& n, std::vector<R>& dst);
 
     private:
+        //the subscription index is an m_tree keyed by handle, copies rebuild it from its leaves
+        template <class, size_t, typename, typename, typename> friend class m_tree;
+
         size_t tree_size;
         std::function<R(const T&, const T&)> d;
         std::shared_ptr<tree_node> root;
         std::map<split_policy, partition_function> split_functions;
         split_policy policy;
         partition_algorithm partition_method;
-    };
+        //sorted sample of pairwise distances, empty until estimate_distance_distribution is called
+        std::vector<R> distance_distribution;
+        std::default_random_engine generator;
 
+        /*
+            Subscriptions are indexed by their query objects, a new object o matches subscription s when
+            d(o, query_s) <= radius_s so a range query for o with the largest radius finds every candidate.
+            Handles index subscriptions, unsubscribing deletes the entry from the index.
+            */
+        struct subscription
+        {
+            R radius;
+            notify_callback callback;
+            bool active;
+        };
+        struct notification
+        {
+            size_t handle;
+            ID id;
+            R distance;
+        };
+        /*
+            Owns the subscription index. Copies rebuild the index from the queries of the source so a
+            copied tree never sees handles of subscriptions it does not hold
+            */
+        struct subscription_tree
+        {
+            std::unique_ptr<m_tree<T, C, R, size_t, V>> index;
+
+            subscription_tree() {}
+            subscription_tree(const subscription_tree& other) { copy(other); }
+            subscription_tree& operator=(const subscription_tree& other)
+            {
+                if (this != &other)
+                    copy(other);
+                return *this;
+            }
+            m_tree<T, C, R, size_t, V>* operator->() const { return index.get(); }
+            explicit operator bool() const { return static_cast<bool>(index); }
+            void reset(m_tree<T, C, R, size_t, V>* tree) { index.reset(tree); }
+
+            void copy(const subscription_tree& other)
+            {
+                index.reset();
+                if (!other.index)
+                    return;
+                index.reset(new m_tree<T, C, R, size_t, V>(other.index->d));
+                std::vector<std::shared_ptr<typename m_tree<T, C, R, size_t, V>::tree_node>> leaves;
+                other.index->collect_leaves(other.index->root, leaves);
+                for (const auto& leaf : leaves)
+                {
+                    for (const auto& lo : boost::get<typename m_tree<T, C, R, size_t, V>::leaf_set>(leaf->data))
+                    {
+                        if (lo.value)
+                            index->insert(lo.id, std::make_shared<T>(*lo.value));
+                    }
+                }
+            }
+        };
+        std::vector<subscription> subscriptions;
+        subscription_tree subscription_index;
+        R max_subscription_radius;
+        notification_mode notify_mode;
+        std::vector<notification> notifications;
+
+        /*
+            Objects by hash, kept alongside the tree while a hash function is set. Entries are added on
+            insert and removed with the objects by delete_where and expire. The objects stay in the tree, an
+            entry locates the leaf holding its object so a hit is confirmed there without a search
+            */
+        struct hashed_object
+        {
+            ID id;
+            std::weak_ptr<tree_node> leaf;
+            time_point timestamp;
+        };
+        hash_function hash;
+        std::unordered_multimap<size_t, hashed_object> hashed_objects;
+
+        double compaction_threshold;
+        //subtrees waiting to be rebuilt, most recently queued first
+        std::vector<std::weak_ptr<tree_node>> compaction_queue;
+    };
 
 
 
 
-    template < class T, size_t C, typename R, typename ID>
-    m_tree<T, C, R, ID>::m_tree(distance_function dist_func) :
+
+    template < class T, size_t C, typename R, typename ID, typename V>
+    m_tree<T, C, R, ID, V>::m_tree(distance_function dist_func) :
         tree_size(0),
         d(dist_func),
         policy(split_policy::M_LB_DIST),
-        partition_method(partition_algorithm::BALANCED)
+        partition_method(partition_algorithm::BALANCED),
+        max_subscription_radius(static_cast<R>(0)),
+        notify_mode(notification_mode::SYNCHRONOUS),
+        compaction_threshold(0.5)
     {
         static_assert(std::is_arithmetic<R>::value, "distance function must return arithmetic type");
         static_assert(C > 1, "Node capacity must be >1");
@@ -387,26 +1197,26 @@ namespace mt
     }
 
 
-    template < class T, size_t C, typename R, typename ID>
-    m_tree<T, C, R, ID>::~m_tree()
+    template < class T, size_t C, typename R, typename ID, typename V>
+    m_tree<T, C, R, ID, V>::~m_tree()
     {
 
     }
 
-    template < class T, size_t C, typename R, typename ID>
-    bool m_tree<T, C, R, ID>::empty() const
+    template < class T, size_t C, typename R, typename ID, typename V>
+    bool m_tree<T, C, R, ID, V>::empty() const
     {
         return 0 == tree_size;
     }
 
-    template < class T, size_t C, typename R, typename ID>
-    size_t m_tree<T, C, R, ID>::size() const
+    template < class T, size_t C, typename R, typename ID, typename V>
+    size_t m_tree<T, C, R, ID, V>::size() const
     {
         return tree_size;
     }
 
-    template < class T, size_t C, typename R, typename ID>
-    double m_tree<T, C, R, ID>::fat_factor() const
+    template < class T, size_t C, typename R, typename ID, typename V>
+    double m_tree<T, C, R, ID, V>::fat_factor() const
     {
         /*
         fat = ((Ic - h*n)/n)*(1/(m-h))
@@ -431,8 +1241,8 @@ namespace mt
 
     }
 
-    template < class T, size_t C, typename R, typename ID>
-    size_t m_tree<T, C, R, ID>::depth(std::weak_ptr<tree_node> node) const
+    template < class T, size_t C, typename R, typename ID, typename V>
+    size_t m_tree<T, C, R, ID, V>::depth(std::weak_ptr<tree_node> node) const
     {
         if (auto lock = node.lock())
         {
@@ -450,60 +1260,622 @@ namespace mt
         return 0;
     }
 
-    template < class T, size_t C, typename R, typename ID>
-    void m_tree<T, C, R, ID>::clear()
+    template < class T, size_t C, typename R, typename ID, typename V>
+    void m_tree<T, C, R, ID, V>::clear()
     {
         root.reset();
+        tree_size = 0;
+        hashed_objects.clear();
+        compaction_queue.clear();
     }
 
-    template < class T, size_t C, typename R, typename ID>
-    void m_tree<T, C, R, ID>::set_distance_function(distance_function dist_func)
+    template < class T, size_t C, typename R, typename ID, typename V>
+    void m_tree<T, C, R, ID, V>::set_distance_function(distance_function dist_func)
     {
         d = dist_func;
+        if (subscription_index)
+            subscription_index->set_distance_function(dist_func);
+    }
+
+    template < class T, size_t C, typename R, typename ID, typename V>
+    void m_tree<T, C, R, ID, V>::set_notification_mode(notification_mode mode)
+    {
+        notify_mode = mode;
     }
 
 
-    template < class T, size_t C, typename R, typename ID>
-    void m_tree<T, C, R, ID>::set_split_policy(split_policy p)
+    template < class T, size_t C, typename R, typename ID, typename V>
+    void m_tree<T, C, R, ID, V>::set_split_policy(split_policy p)
     {
         policy = p;
     }
 
-    template < class T, size_t C, typename R, typename ID>
-    void m_tree<T, C, R, ID>::set_partition_algorithm(partition_algorithm algorithm)
+    template < class T, size_t C, typename R, typename ID, typename V>
+    void m_tree<T, C, R, ID, V>::set_partition_algorithm(partition_algorithm algorithm)
     {
         partition_method = algorithm;
     }
 
-    template < class T, size_t C, typename R, typename ID>
-    void m_tree<T, C, R, ID>::insert(ID id, std::shared_ptr<T> t)
+    template < class T, size_t C, typename R, typename ID, typename V>
+    void m_tree<T, C, R, ID, V>::insert(ID id, std::shared_ptr<T> t)
+    {
+        insert(id, t, std::chrono::steady_clock::now());
+    }
+
+    template < class T, size_t C, typename R, typename ID, typename V>
+    void m_tree<T, C, R, ID, V>::insert(ID id, std::shared_ptr<T> t, time_point stamp)
+    {
+        insert_object(id, V::hold(t), distance_cache(), stamp);
+    }
+
+    template < class T, size_t C, typename R, typename ID, typename V>
+    void m_tree<T, C, R, ID, V>::insert(ID id, T&& t)
+    {
+        insert(id, std::move(t), std::chrono::steady_clock::now());
+    }
+
+    template < class T, size_t C, typename R, typename ID, typename V>
+    void m_tree<T, C, R, ID, V>::insert(ID id, T&& t, time_point stamp)
+    {
+        insert_object(id, V::template emplace<T>(std::move(t)), distance_cache(), stamp);
+    }
+
+    template < class T, size_t C, typename R, typename ID, typename V>
+    template <class... Args>
+    void m_tree<T, C, R, ID, V>::emplace(ID id, Args&&... args)
+    {
+        emplace_stamped(id, std::chrono::steady_clock::now(), std::forward<Args>(args)...);
+    }
+
+    template < class T, size_t C, typename R, typename ID, typename V>
+    template <class... Args>
+    void m_tree<T, C, R, ID, V>::emplace_stamped(ID id, time_point stamp, Args&&... args)
+    {
+        insert_object(id, V::template emplace<T>(std::forward<Args>(args)...), distance_cache(), stamp);
+    }
+
+    template < class T, size_t C, typename R, typename ID, typename V>
+    void m_tree<T, C, R, ID, V>::insert_object(ID id, value_holder&& held, const distance_cache& known, time_point stamp)
     {
         if (!root)
         {
             root = std::make_shared<tree_node>();
         }
-        insert(id, t, root);
+        hash_object(id, *held, stamp, std::weak_ptr<tree_node>());
+        //held is moved into its leaf, subscribers are matched against a copy kept only when there are any
+        value_holder matched;
+        if (subscription_index && false == subscription_index->empty())
+            matched = held;
+        insert(id, std::move(held), root, known, stamp);
         tree_size++;
+        if (matched)
+            notify_subscribers(id, *matched);
+        //deferred compaction is spread over inserts, one subtree each
+        if (false == compaction_queue.empty())
+        {
+            std::weak_ptr<tree_node> node = compaction_queue.back();
+            compaction_queue.pop_back();
+            compact_node(node.lock());
+        }
+    }
+
+    template < class T, size_t C, typename R, typename ID, typename V>
+    std::pair<ID, bool> m_tree<T, C, R, ID, V>::insert_if_no_neighbor(ID id, std::shared_ptr<T> t, R eps)
+    {
+        /*
+            The distances to the routing objects computed while looking for a neighbour are kept, the
+            insertion descends through routers the search already visited and reuses them.
+            */
+        distance_cache known;
+        ID found;
+        if (find_neighbor(*t, eps, found, known))
+            return std::make_pair(found, false);
+        insert_object(id, V::hold(t), known, std::chrono::steady_clock::now());
+        return std::make_pair(id, true);
+    }
+
+    template < class T, size_t C, typename R, typename ID, typename V>
+    size_t m_tree<T, C, R, ID, V>::expire(time_point before)
+    {
+        /*
+            Routing objects record the newest timestamp below them, a subtree with nothing newer than
+            before is dropped whole without being visited. Covering radii of the remaining routing objects
+            are recomputed on the way back up, they can only shrink. A root left with a single routing
+            object is replaced by its subtree so the height follows the size of the window.
+            */
+        if (!root)
+            return 0;
+        size_t removed = expire_node(root, before);
+        tree_size -= removed;
+        shrink_root();
+        if (removed > 0)
+        {
+            for (auto it = hashed_objects.begin(); it != hashed_objects.end();)
+                it = it->second.timestamp < before ? hashed_objects.erase(it) : std::next(it);
+        }
+        return removed;
+    }
+
+    template < class T, size_t C, typename R, typename ID, typename V>
+    void m_tree<T, C, R, ID, V>::shrink_root()
+    {
+        while (root && root->internal_node())
+        {
+            route_set& rs = boost::get<route_set>(root->data);
+            size_t used = std::count_if(std::begin(rs), std::end(rs), [](const routing_object& ro)
+            {
+                return static_cast<bool>(ro.covering_tree);
+            });
+            if (used > 1)
+                break;
+            if (0 == used)
+            {
+                root = std::make_shared<tree_node>();
+                break;
+            }
+            root = std::find_if(std::begin(rs), std::end(rs), [](const routing_object& ro)
+            {
+                return static_cast<bool>(ro.covering_tree);
+            })->covering_tree;
+            root->parent.reset();
+            //entries of the root are not relative to any routing object
+            if (root->internal_node())
+            {
+                for (routing_object& ro : boost::get<route_set>(root->data))
+                    ro.distance = static_cast<R>(0);
+            }
+            else
+            {
+                for (leaf_object& lo : boost::get<leaf_set>(root->data))
+                    lo.distance = static_cast<R>(0);
+            }
+        }
+    }
+
+    template < class T, size_t C, typename R, typename ID, typename V>
+    size_t m_tree<T, C, R, ID, V>::delete_where(const id_filter& predicate)
+    {
+        /*
+            Deleted objects leave a free slot in their leaf, the same as a slot never filled, so queries
+            skip them at no cost. Restructuring is deferred: routing objects count the objects deleted
+            below them, and once that passes the compaction threshold of what the subtree held the subtree
+            is queued to have its remaining objects reinserted, tightening radii and refilling nodes.
+            */
+        if (!root)
+            return 0;
+        size_t removed = delete_node(root, predicate);
+        tree_size -= removed;
+        shrink_root();
+        if (removed > 0)
+        {
+            for (auto it = hashed_objects.begin(); it != hashed_objects.end();)
+                it = predicate(it->second.id) ? hashed_objects.erase(it) : std::next(it);
+        }
+        return removed;
+    }
+
+    template < class T, size_t C, typename R, typename ID, typename V>
+    size_t m_tree<T, C, R, ID, V>::delete_node(std::shared_ptr<tree_node> node, const id_filter& predicate)
+    {
+        size_t removed = 0;
+        if (node->internal_node())
+        {
+            get_covering_radius radius_getter;
+            for (routing_object& ro : boost::get<route_set>(node->data))
+            {
+                if (!ro.covering_tree)
+                    continue;
+                size_t dropped = delete_node(ro.covering_tree, predicate);
+                if (0 == dropped)
+                    continue;
+                removed += dropped;
+                ro.count -= dropped;
+                ro.deleted += dropped;
+                if (0 == ro.count)
+                {
+                    ro = routing_object();
+                    continue;
+                }
+                ro.covering_radius = boost::apply_visitor(radius_getter, ro.covering_tree->data);
+                //queued after its descendants so it is rebuilt first, which discards them
+                if (ro.deleted > compaction_threshold * (ro.count + ro.deleted))
+                    compaction_queue.push_back(ro.covering_tree);
+            }
+        }
+        else if (node->leaf_node())
+        {
+            for (leaf_object& lo : boost::get<leaf_set>(node->data))
+            {
+                if (lo.value && predicate(lo.id))
+                {
+                    lo = leaf_object();
+                    removed++;
+                }
+            }
+        }
+        return removed;
+    }
+
+    template < class T, size_t C, typename R, typename ID, typename V>
+    void m_tree<T, C, R, ID, V>::compact()
+    {
+        while (false == compaction_queue.empty())
+        {
+            std::weak_ptr<tree_node> node = compaction_queue.back();
+            compaction_queue.pop_back();
+            compact_node(node.lock());
+        }
+    }
+
+    template < class T, size_t C, typename R, typename ID, typename V>
+    void m_tree<T, C, R, ID, V>::relocate(const std::function<T(const T&)>& relocation)
+    {
+        std::vector<std::shared_ptr<tree_node>> leaves;
+        collect_leaves(root, leaves);
+        for (const std::shared_ptr<tree_node>& leaf : leaves)
+        {
+            for (leaf_object& lo : boost::get<leaf_set>(leaf->data))
+            {
+                if (lo.value)
+                    lo.value = V::template emplace<T>(relocation(*lo.value));
+            }
+        }
+        std::vector<std::weak_ptr<tree_node>> queue;
+        if (root)
+            queue.push_back(root);
+        while (false == queue.empty())
+        {
+            std::shared_ptr<tree_node> current = queue.back().lock();
+            queue.pop_back();
+            if (!current || false == current->internal_node())
+                continue;
+            for (routing_object& ro : boost::get<route_set>(current->data))
+            {
+                if (ro.covering_tree)
+                {
+                    ro.value = V::template emplace<T>(relocation(*ro.value));
+                    queue.push_back(ro.covering_tree);
+                }
+            }
+        }
+        if (subscription_index)
+            subscription_index->relocate(relocation);
+    }
+
+    template < class T, size_t C, typename R, typename ID, typename V>
+    void m_tree<T, C, R, ID, V>::set_compaction_threshold(double threshold)
+    {
+        BOOST_ASSERT_MSG(threshold >= 0.0 && threshold <= 1.0, "set_compaction_threshold: threshold is a fraction");
+        compaction_threshold = threshold;
+    }
+
+    template < class T, size_t C, typename R, typename ID, typename V>
+    void m_tree<T, C, R, ID, V>::compact_node(std::shared_ptr<tree_node> node)
+    {
+        //already rebuilt as part of an ancestor, dropped or now the root
+        if (!node || node == root)
+            return;
+        std::shared_ptr<tree_node> parent = node->parent.lock();
+        if (!parent)
+            return;
+        std::vector<std::shared_ptr<tree_node>> leaves;
+        collect_leaves(node, leaves);
+        std::vector<leaf_object> objects;
+        for (const std::shared_ptr<tree_node>& leaf : leaves)
+        {
+            for (const leaf_object& lo : boost::get<leaf_set>(leaf->data))
+            {
+                if (lo.value)
+                    objects.push_back(lo);
+            }
+        }
+        //unlink the subtree, ancestors left empty go with it
+        std::shared_ptr<tree_node> child = node;
+        while (parent)
+        {
+            for (routing_object& ro : boost::get<route_set>(parent->data))
+            {
+                if (ro.covering_tree != child)
+                    continue;
+                ro.count -= objects.size();
+                if (child == node || 0 == ro.count)
+                    ro = routing_object();
+                break;
+            }
+            child = parent;
+            parent = parent->parent.lock();
+        }
+        shrink_root();
+        for (leaf_object& lo : objects)
+        {
+            insert(lo.id, std::move(lo.value), root, distance_cache(), lo.timestamp);
+        }
+    }
+
+    template < class T, size_t C, typename R, typename ID, typename V>
+    size_t m_tree<T, C, R, ID, V>::expire_node(std::shared_ptr<tree_node> node, time_point before)
+    {
+        size_t removed = 0;
+        if (node->internal_node())
+        {
+            get_covering_radius radius_getter;
+            for (routing_object& ro : boost::get<route_set>(node->data))
+            {
+                if (!ro.covering_tree)
+                    continue;
+                size_t dropped = ro.newest < before ? ro.count : expire_node(ro.covering_tree, before);
+                removed += dropped;
+                ro.count -= dropped;
+                if (0 == ro.count)
+                {
+                    ro = routing_object();
+                }
+                else if (dropped > 0)
+                {
+                    ro.covering_radius = boost::apply_visitor(radius_getter, ro.covering_tree->data);
+                }
+            }
+        }
+        else if (node->leaf_node())
+        {
+            for (leaf_object& lo : boost::get<leaf_set>(node->data))
+            {
+                if (lo.value && lo.timestamp < before)
+                {
+                    lo = leaf_object();
+                    removed++;
+                }
+            }
+        }
+        return removed;
+    }
+
+    template < class T, size_t C, typename R, typename ID, typename V>
+    void m_tree<T, C, R, ID, V>::set_hash_function(hash_function hasher)
+    {
+        hash = hasher;
+        hashed_objects.clear();
+        if (!hash)
+            return;
+        std::vector<std::shared_ptr<tree_node>> leaves;
+        collect_leaves(root, leaves);
+        for (const std::shared_ptr<tree_node>& leaf : leaves)
+        {
+            for (const leaf_object& lo : boost::get<leaf_set>(leaf->data))
+            {
+                if (lo.value)
+                    hash_object(lo.id, *lo.value, lo.timestamp, leaf);
+            }
+        }
+    }
+
+    template < class T, size_t C, typename R, typename ID, typename V>
+    void m_tree<T, C, R, ID, V>::hash_object(const ID& id, const T& value, time_point stamp, std::weak_ptr<tree_node> leaf)
+    {
+        if (!hash)
+            return;
+        hashed_object entry;
+        entry.id = id;
+        entry.leaf = leaf;
+        entry.timestamp = stamp;
+        hashed_objects.insert(std::make_pair(hash(value), entry));
+    }
+
+    template < class T, size_t C, typename R, typename ID, typename V>
+    void m_tree<T, C, R, ID, V>::locate_object(const leaf_object& lo, std::shared_ptr<tree_node> leaf)
+    {
+        auto candidates = hashed_objects.equal_range(hash(*lo.value));
+        for (auto it = candidates.first; it != candidates.second; ++it)
+        {
+            if (it->second.id == lo.id)
+                it->second.leaf = leaf;
+        }
+    }
+
+    template < class T, size_t C, typename R, typename ID, typename V>
+    void m_tree<T, C, R, ID, V>::locate_objects(std::shared_ptr<tree_node> leaf)
+    {
+        for (const leaf_object& lo : boost::get<leaf_set>(leaf->data))
+        {
+            if (lo.value)
+                locate_object(lo, leaf);
+        }
+    }
+
+    template < class T, size_t C, typename R, typename ID, typename V>
+    bool m_tree<T, C, R, ID, V>::contains(const T& obj) const
+    {
+        return find(obj).second;
+    }
+
+    template < class T, size_t C, typename R, typename ID, typename V>
+    std::pair<ID, bool> m_tree<T, C, R, ID, V>::find(const T& obj) const
+    {
+        ID found = ID();
+        if (hash)
+        {
+            //the hash only narrows the candidates down, collisions are told apart by distance in their leaves
+            auto candidates = hashed_objects.equal_range(hash(obj));
+            for (auto it = candidates.first; it != candidates.second; ++it)
+            {
+                std::shared_ptr<tree_node> leaf = it->second.leaf.lock();
+                if (!leaf)
+                    continue;
+                for (const leaf_object& lo : boost::get<leaf_set>(leaf->data))
+                {
+                    if (lo.value && lo.id == it->second.id && d(obj, *lo.value) == static_cast<R>(0))
+                        return std::make_pair(lo.id, true);
+                }
+            }
+            return std::make_pair(found, false);
+        }
+        distance_cache known;
+        bool exists = find_neighbor(obj, static_cast<R>(0), found, known);
+        return std::make_pair(found, exists);
+    }
+
+    template < class T, size_t C, typename R, typename ID, typename V>
+    size_t m_tree<T, C, R, ID, V>::subscribe(const T& query, R radius, const notify_callback& callback)
+    {
+        if (!subscription_index)
+            subscription_index.reset(new m_tree<T, C, R, size_t, V>(d));
+        subscription s;
+        s.radius = radius;
+        s.callback = callback;
+        s.active = true;
+        subscriptions.push_back(s);
+        max_subscription_radius = std::max(max_subscription_radius, radius);
+        subscription_index->insert(subscriptions.size() - 1, std::make_shared<T>(query));
+        return subscriptions.size() - 1;
+    }
+
+    template < class T, size_t C, typename R, typename ID, typename V>
+    void m_tree<T, C, R, ID, V>::unsubscribe(size_t handle)
+    {
+        BOOST_ASSERT_MSG(handle < subscriptions.size(), "unsubscribe: unknown handle");
+        if (false == subscriptions[handle].active)
+            return;
+        //the slot stays so handles remain stable, queued notifications see it inactive
+        subscriptions[handle].active = false;
+        subscriptions[handle].callback = notify_callback();
+        subscription_index->delete_where([handle](const size_t& h) { return h == handle; });
+    }
+
+    template < class T, size_t C, typename R, typename ID, typename V>
+    size_t m_tree<T, C, R, ID, V>::poll_notifications()
+    {
+        //callbacks may insert, which can queue more notifications, so the queue is swapped out first
+        std::vector<notification> delivering;
+        delivering.swap(notifications);
+        size_t delivered = 0;
+        for (const notification& n : delivering)
+        {
+            if (subscriptions[n.handle].active)
+            {
+                subscriptions[n.handle].callback(n.id, n.distance);
+                delivered++;
+            }
+        }
+        return delivered;
+    }
+
+    template < class T, size_t C, typename R, typename ID, typename V>
+    void m_tree<T, C, R, ID, V>::notify_subscribers(const ID& id, const T& value)
+    {
+        if (!subscription_index || subscription_index->empty())
+            return;
+        std::vector<R> distances;
+        std::vector<size_t> candidates = subscription_index->range_search(value, max_subscription_radius,
+            nullptr, time_point::min(), subscription_index->d, &distances);
+        for (size_t i = 0; i < candidates.size(); i++)
+        {
+            const subscription& s = subscriptions[candidates[i]];
+            if (false == s.active || distances[i] > s.radius)
+                continue;
+            if (notification_mode::SYNCHRONOUS == notify_mode)
+            {
+                s.callback(id, distances[i]);
+            }
+            else
+            {
+                notification n;
+                n.handle = candidates[i];
+                n.id = id;
+                n.distance = distances[i];
+                notifications.push_back(n);
+            }
+        }
+    }
+
+    template < class T, size_t C, typename R, typename ID, typename V>
+    R m_tree<T, C, R, ID, V>::rounding_slack(R a, R b)
+    {
+        return std::numeric_limits<R>::epsilon() * (std::abs(a) + std::abs(b));
+    }
+
+    template < class T, size_t C, typename R, typename ID, typename V>
+    bool m_tree<T, C, R, ID, V>::find_neighbor(const T& t, R eps, ID& found, distance_cache& known) const
+    {
+        //depth first with the closest router first, stopping at the first object within eps
+        std::vector<std::pair<std::weak_ptr<tree_node>, R>> stack;
+        if (root)
+            stack.push_back(std::make_pair(std::weak_ptr<tree_node>(root), static_cast<R>(0)));
+        while (false == stack.empty())
+        {
+            auto locked = stack.back().first.lock();
+            R dist_to_parent = stack.back().second;
+            stack.pop_back();
+            if (!locked)
+                continue;
+            bool has_parent = locked != root;
+            if (locked->internal_node())
+            {
+                size_t first = stack.size();
+                for (const routing_object& ro : boost::get<route_set>(locked->data))
+                {
+                    const T* value = ro.value.get();
+                    if (!value)
+                        continue;
+                    if (has_parent && std::abs(dist_to_parent - ro.distance) >
+                        eps + ro.covering_radius + rounding_slack(dist_to_parent, ro.distance))
+                        continue;
+                    R distance = d(t, *value);
+                    known[value] = distance;
+                    if (distance <= eps + ro.covering_radius + rounding_slack(distance, ro.covering_radius))
+                        stack.push_back(std::make_pair(std::weak_ptr<tree_node>(ro.covering_tree), distance));
+                }
+                std::sort(std::begin(stack) + first, std::end(stack),
+                    [](const std::pair<std::weak_ptr<tree_node>, R>& a, const std::pair<std::weak_ptr<tree_node>, R>& b)
+                {
+                    return a.second > b.second;
+                });
+            }
+            else if (locked->leaf_node())
+            {
+                for (const leaf_object& lo : boost::get<leaf_set>(locked->data))
+                {
+                    if (!lo.value)
+                        continue;
+                    if (has_parent && std::abs(dist_to_parent - lo.distance) > eps + rounding_slack(dist_to_parent, lo.distance))
+                        continue;
+                    if (d(t, *lo.value) <= eps)
+                    {
+                        found = lo.id;
+                        return true;
+                    }
+                }
+            }
+        }
+        return false;
+    }
+
+    template < class T, size_t C, typename R, typename ID, typename V>
+    R m_tree<T, C, R, ID, V>::cached_distance(const T& t, const T& router, const distance_cache& known) const
+    {
+        auto it = known.find(&router);
+        return it != known.end() ? it->second : d(t, router);
     }
 
-    template < class T, size_t C, typename R, typename ID>
-    void m_tree<T, C, R, ID>::insert(ID id, std::weak_ptr<T> t, std::weak_ptr<tree_node> node)
+    template < class T, size_t C, typename R, typename ID, typename V>
+    void m_tree<T, C, R, ID, V>::insert(ID id, value_holder&& t, std::weak_ptr<tree_node> node, const distance_cache& known,
+        time_point stamp)
     {
         if (auto lock = node.lock())
         {
             if (lock->internal_node())
             {
-                internal_node_insert(id, t, node);
+                internal_node_insert(id, std::move(t), node, known, stamp);
             }
             else if (lock->leaf_node())
             {
-                leaf_node_insert(id, t, node);
+                leaf_node_insert(id, std::move(t), node, known, stamp);
             }
         }
     }
 
-    template < class T, size_t C, typename R, typename ID>
-    void m_tree<T, C, R, ID>::internal_node_insert(ID id, std::weak_ptr<T> t, std::weak_ptr<tree_node> N)
+    template < class T, size_t C, typename R, typename ID, typename V>
+    void m_tree<T, C, R, ID, V>::internal_node_insert(ID id, value_holder&& t, std::weak_ptr<tree_node> N,
+        const distance_cache& known, time_point stamp)
     {
         if (auto lock = N.lock())
         {
@@ -511,16 +1883,17 @@ namespace mt
 
             route_set& rs = boost::get<route_set>(lock->data);
             std::array<R, C> distances;
+            std::array<R, C> router_distances;
             std::fill(std::begin(distances), std::end(distances), std::numeric_limits<R>::max());
-            if (auto t_locked = t.lock())
+            if (t)
             {
                 for (size_t i = 0; i < C; i++)
                 {
-                    if (auto temp = rs[i].value.lock())
+                    if (const T* temp = rs[i].value.get())
                     {
-                        R distance = d(*t_locked, *temp);
-                        if (distance <= rs[i].covering_radius)
-                            distances[i] = distance;
+                        router_distances[i] = cached_distance(*t, *temp, known);
+                        if (router_distances[i] <= rs[i].covering_radius)
+                            distances[i] = router_distances[i];
                     }
                 }
             
@@ -529,22 +1902,26 @@ namespace mt
                 {
                     for (size_t i = 0; i < rs.size(); i++)
                     {
-                        if (auto temp = rs[i].value.lock())
+                        if (rs[i].value)
                         {
-                            distances[i] = d(*t_locked, *temp) - rs[i].covering_radius;
+                            distances[i] = router_distances[i] - rs[i].covering_radius;
                         }
                     }
                     min_router = std::min_element(std::begin(distances), std::end(distances));
                     rs[std::distance(std::begin(distances), min_router)].covering_radius += *min_router;
                 }
-                insert(id, t, rs[std::distance(std::begin(distances), min_router)].covering_tree);
+                routing_object& chosen = rs[std::distance(std::begin(distances), min_router)];
+                chosen.count++;
+                chosen.newest = std::max(chosen.newest, stamp);
+                insert(id, std::move(t), chosen.covering_tree, known, stamp);
             }
         }
     }
 
 
-    template < class T, size_t C, typename R, typename ID>
-    void m_tree<T, C, R, ID>::leaf_node_insert(ID id, std::weak_ptr<T> t, std::weak_ptr<tree_node> lo)
+    template < class T, size_t C, typename R, typename ID, typename V>
+    void m_tree<T, C, R, ID, V>::leaf_node_insert(ID id, value_holder&& t, std::weak_ptr<tree_node> lo,
+        const distance_cache& known, time_point stamp)
     {
         if (auto lock = lo.lock())
         {
@@ -553,41 +1930,32 @@ namespace mt
             leaf_set& ls = boost::get<leaf_set>(lock->data);
             for (size_t i = 0; i < ls.size(); i++)
             {
-                if (false == ls[i].value)
+                if (!ls[i].value)
                 {
-                    if (auto parent = lock->parent.lock())
+                    if (const T* router = routing_value(lock))
                     {
-                        std::vector<std::weak_ptr<T>> values;
-                        get_object_values getter(values);
-                        boost::apply_visitor(getter, parent->data);
-                        for (size_t j = 0; j < C; j++)
-                        {
-                            for (size_t k = 0; k < C; k++)
-                            {
-                                if (values[j].lock() == ls[k].value && nullptr != ls[k].value)
-                                {
-                                    ls[i].distance = d(*ls[k].value, *t.lock());
-                                    j = C; k = C; //quick break out of loop
-                                }
-                            }
-                        }
+                        ls[i].distance = cached_distance(*t, *router, known);
                     }
-                    ls[i].value = t.lock();
+                    ls[i].value = std::move(t);
                     ls[i].id = id;
+                    ls[i].timestamp = stamp;
+                    if (hash)
+                        locate_object(ls[i], lock);
                     update_covering_radius(lock->parent);
                     return;
                 }
             }
             leaf_object leaf;
             leaf.id = id;
-            leaf.value = t.lock();
+            leaf.value = std::move(t);
+            leaf.timestamp = stamp;
             boost::variant<leaf_object, routing_object> temp = leaf;
             split(temp, lo);
         }
     }
 
-    template < class T, size_t C, typename R, typename ID>
-    void m_tree<T, C, R, ID>::split(boost::variant<leaf_object, routing_object>& obj, std::weak_ptr<tree_node> n)
+    template < class T, size_t C, typename R, typename ID, typename V>
+    void m_tree<T, C, R, ID, V>::split(boost::variant<leaf_object, routing_object>& obj, std::weak_ptr<tree_node> n)
     {
         if (auto locked = n.lock())
         {
@@ -597,6 +1965,12 @@ namespace mt
             boost::apply_visitor(getter, locked->data);
             routing_object o1, o2;
             promote(objects, o1, o2);
+            //the objects of a split leaf move to the two new leaves
+            if (hash && locked->leaf_node())
+            {
+                locate_objects(o1.covering_tree);
+                locate_objects(o2.covering_tree);
+            }
             if (locked == root)
             {
                 std::shared_ptr<tree_node> new_root = std::make_shared<tree_node>();
@@ -614,30 +1988,32 @@ namespace mt
                 {
                     bool split_again = true;
                     route_set& parent_ros = boost::get<route_set>(p_lock->data);
-                    for (size_t i = 0; i < parent_ros.size(); i++)
+                    //distances are relative to the routing object p_lock hangs from, the root has none
+                    if (const T* r_temp = routing_value(p_lock))
+                    {
+                        if (const T* l_temp = o2.value.get())
+                            o2.distance = d(*r_temp, *l_temp);
+
+                        if (const T* l_temp = o1.value.get())
+                            o1.distance = d(*r_temp, *l_temp);
+                    }
+                    for (size_t i = 0; i < parent_ros.size(); i++)
                     {
-                        if (parent_ros[i].covering_tree && parent_ros[i].distance == 0)
-                        {                            
-                            if (auto r_temp = parent_ros[i].value.lock())
-                            {
-                                if (auto l_temp = o2.value.lock())
-                                    o2.distance = d(*r_temp, *l_temp);
-                                
-                                if (auto l_temp = o1.value.lock())
-                                    o1.distance = d(*r_temp, *l_temp);
-                            }
-                        }
                         if (parent_ros[i].covering_tree == locked)
                         {
                             o1.covering_tree->parent = p_lock;
                             parent_ros[i] = o1;
+                            break;
                         }
-                        else if (false == parent_ros[i].covering_tree)
+                    }
+                    for (size_t i = 0; i < parent_ros.size(); i++)
+                    {
+                        if (false == parent_ros[i].covering_tree)
                         {
-
                             o2.covering_tree->parent = p_lock;
                             parent_ros[i] = o2;
                             split_again = false;
+                            break;
                         }
                     }
                     if (split_again)
@@ -645,14 +2021,17 @@ namespace mt
                         boost::variant<leaf_object, routing_object> temp=o2;
                         split(temp, p_lock);
                     }
-                    update_covering_radius(p_lock->parent);
+                    else
+                    {
+                        update_covering_radius(p_lock->parent);
+                    }
                 }
             }
         }
     }
 
-    template < class T, size_t C, typename R, typename ID>
-    void m_tree<T, C, R, ID>::update_covering_radius(std::weak_ptr<tree_node> node)
+    template < class T, size_t C, typename R, typename ID, typename V>
+    void m_tree<T, C, R, ID, V>::update_covering_radius(std::weak_ptr<tree_node> node)
     {
         if (auto locked = node.lock())
         {
@@ -664,7 +2043,7 @@ namespace mt
                 get_covering_radius radius_getter;
                 for (routing_object& ro : rs)
                 {
-                    if (ro.value.expired())
+                    if (!ro.value)
                         continue;
                     R temp = boost::apply_visitor(radius_getter, ro.covering_tree->data);
                     if (std::abs(temp - ro.covering_radius) > std::numeric_limits<R>::epsilon())
@@ -681,8 +2060,25 @@ namespace mt
         }
     }
 
-    template < class T, size_t C, typename R, typename ID>
-    void m_tree<T, C, R, ID>::promote(const data_vector& objs, routing_object& o1, routing_object& o2)
+    template < class T, size_t C, typename R, typename ID, typename V>
+    const T* m_tree<T, C, R, ID, V>::routing_value(std::shared_ptr<tree_node> node) const
+    {
+        if (node)
+        {
+            if (auto parent = node->parent.lock())
+            {
+                for (const routing_object& ro : boost::get<route_set>(parent->data))
+                {
+                    if (ro.covering_tree == node)
+                        return ro.value.get();
+                }
+            }
+        }
+        return nullptr;
+    }
+
+    template < class T, size_t C, typename R, typename ID, typename V>
+    void m_tree<T, C, R, ID, V>::promote(const data_vector& objs, routing_object& o1, routing_object& o2)
     {
         switch (policy)
         {
@@ -705,36 +2101,36 @@ namespace mt
     }
 
 
-    template < class T, size_t C, typename R, typename ID>
-    void m_tree<T, C, R, ID>::partition(const data_vector& o, routing_object& n1, routing_object& n2, std::vector<R> distances = std::vector<R>())
+    template < class T, size_t C, typename R, typename ID, typename V>
+    void m_tree<T, C, R, ID, V>::partition(const data_vector& o, size_t n1_index, size_t n2_index,
+        routing_object& n1, routing_object& n2, std::vector<R> distances = std::vector<R>())
     {
         if (distances.empty())
         {
             calculate_distance_matrix(o, distances);
         }
         BOOST_ASSERT_MSG(distances.size() == o.size()*o.size(), "NOT ENOUGH DISTANCES");
+        BOOST_ASSERT_MSG(n1_index != n2_index, "PROMOTE FUNCTION CHOSE THE SAME OBJECTS");
+        get_node_holder holder_getter;
+        n1.value = boost::apply_visitor(holder_getter, o[n1_index]);
+        n2.value = boost::apply_visitor(holder_getter, o[n2_index]);
         if (partition_method == partition_algorithm::BALANCED)
         {
-            balanced_partition(o, distances, n1, n2);
+            balanced_partition(o, distances, n1_index, n2_index, n1, n2);
         }
         else if (partition_method == partition_algorithm::GEN_HYPERPLANE)
         {
-            generalised_partition(o, distances, n1, n2);
+            generalised_partition(o, distances, n1_index, n2_index, n1, n2);
         }
     }
 
 
-    template < class T, size_t C, typename R, typename ID>
-    void m_tree<T, C, R, ID>::balanced_partition(const data_vector& o, std::vector<R> distances, 
-        routing_object& n1, routing_object& n2)
+    template < class T, size_t C, typename R, typename ID, typename V>
+    void m_tree<T, C, R, ID, V>::balanced_partition(const data_vector& o, std::vector<R> distances, 
+        size_t n1_index, size_t n2_index, routing_object& n1, routing_object& n2)
     {
         using namespace std::placeholders;
         
-        auto if_routing = [](boost::variant<leaf_object, routing_object> x, std::weak_ptr<T> y){
-            get_node_value getter;
-            auto temp = boost::apply_visitor(getter, x);
-            return temp == y.lock();
-        };
         auto sort_pred = [](const std::pair<size_t, R>& a, const std::pair<size_t, R>& b){
             return a.second < b.second;
         };
@@ -744,10 +2140,6 @@ namespace mt
 
         std::vector<std::pair<size_t, R>> d1(o.size()), d2(o.size());
 
-        size_t n1_index = std::distance(std::begin(o), std::find_if(std::begin(o), std::end(o), std::bind(if_routing, _1, n1.value)));
-        size_t n2_index = std::distance(std::begin(o), std::find_if(std::begin(o), std::end(o), std::bind(if_routing, _1, n2.value)));
-
-        BOOST_ASSERT_MSG(n1_index != n2_index, "PROMOTE FUNCTION CHOSE THE SAME OBJECTS");
         for (size_t i = 0; i < o.size(); i++)
         {
             d1[i] = std::make_pair(i, distances[o.size()*n1_index + i]);
@@ -797,33 +2189,32 @@ namespace mt
             }
         }
         update_parent parent_visitor(d);
+        get_covering_radius radius_getter;
+        get_object_count count_getter;
+        get_newest_timestamp newest_getter;
         n1.covering_tree = std::make_shared<tree_node>();
         parent_visitor.parent = n1.covering_tree;
         boost::apply_visitor(parent_visitor, o[n1_index], data_1);
         n1.covering_tree->data = data_1;
+        n1.covering_radius = boost::apply_visitor(radius_getter, n1.covering_tree->data);
+        n1.count = boost::apply_visitor(count_getter, n1.covering_tree->data);
+        n1.newest = boost::apply_visitor(newest_getter, n1.covering_tree->data);
 
         n2.covering_tree = std::make_shared<tree_node>();
         parent_visitor.parent = n2.covering_tree;
         boost::apply_visitor(parent_visitor, o[n2_index], data_2);
         n2.covering_tree->data = data_2;
+        n2.covering_radius = boost::apply_visitor(radius_getter, n2.covering_tree->data);
+        n2.count = boost::apply_visitor(count_getter, n2.covering_tree->data);
+        n2.newest = boost::apply_visitor(newest_getter, n2.covering_tree->data);
     }
 
-    template < class T, size_t C, typename R, typename ID>
-    void m_tree<T, C, R, ID>::generalised_partition(const data_vector& o, std::vector<R> distances, 
-        routing_object& n1, routing_object& n2)
+    template < class T, size_t C, typename R, typename ID, typename V>
+    void m_tree<T, C, R, ID, V>::generalised_partition(const data_vector& o, std::vector<R> distances, 
+        size_t n1_index, size_t n2_index, routing_object& n1, routing_object& n2)
     {
-        using namespace std::placeholders;
-
-        auto if_routing = [](boost::variant<leaf_object, routing_object> x, std::weak_ptr<T> y){
-            get_node_value getter;
-            auto temp = boost::apply_visitor(getter, x);
-            return temp == y.lock();
-        };
-        size_t n1_index = std::distance(std::begin(o), std::find_if(std::begin(o), std::end(o), std::bind(if_routing, _1, n1.value)));
-        size_t n2_index = std::distance(std::begin(o), std::find_if(std::begin(o), std::end(o), std::bind(if_routing, _1, n2.value)));
         std::vector<R> d1(o.size()), d2(o.size());
         
-        BOOST_ASSERT_MSG(n1_index != n2_index, "PROMOTE FUNCTION CHOSE THE SAME OBJECTS");
         for (size_t i = 0; i < o.size(); i++)
         {
             d1[i] = distances[o.size()*n1_index + i];
@@ -875,133 +2266,148 @@ namespace mt
             }
         }
         update_parent parent_visitor(d);
+        get_covering_radius radius_getter;
+        get_object_count count_getter;
+        get_newest_timestamp newest_getter;
         n1.covering_tree = std::make_shared<tree_node>();
         parent_visitor.parent = n1.covering_tree;
         boost::apply_visitor(parent_visitor, o[n1_index], data_1);
         n1.covering_tree->data = data_1;
+        n1.covering_radius = boost::apply_visitor(radius_getter, n1.covering_tree->data);
+        n1.count = boost::apply_visitor(count_getter, n1.covering_tree->data);
+        n1.newest = boost::apply_visitor(newest_getter, n1.covering_tree->data);
 
         n2.covering_tree = std::make_shared<tree_node>();
         parent_visitor.parent = n2.covering_tree;
         boost::apply_visitor(parent_visitor, o[n2_index], data_2);
         n2.covering_tree->data = data_2;
+        n2.covering_radius = boost::apply_visitor(radius_getter, n2.covering_tree->data);
+        n2.count = boost::apply_visitor(count_getter, n2.covering_tree->data);
+        n2.newest = boost::apply_visitor(newest_getter, n2.covering_tree->data);
     }
 
-    template < class T, size_t C, typename R, typename ID>
-    void m_tree<T, C, R, ID>::minimise_radius(const data_vector& objects, routing_object& o1, routing_object& o2)
+    template < class T, size_t C, typename R, typename ID, typename V>
+    void m_tree<T, C, R, ID, V>::minimise_radius(const data_vector& objects, routing_object& o1, routing_object& o2)
     {
         get_node_value getter;
         R best_cover_radius = std::numeric_limits<R>::max();
         std::vector<R> distance_matrix;
         calculate_distance_matrix(objects, distance_matrix);
 
-        std::pair<routing_object, routing_object> best;
+        size_t best_1 = 0, best_2 = 1;
 
         for (size_t i = 0; i < objects.size(); i++)
         {
-            if (auto lock_1 = boost::apply_visitor(getter, objects[i]))
+            if (boost::apply_visitor(getter, objects[i]))
             {
                 for (size_t j = i + 1; j < objects.size(); j++)
                 {
-                    if (auto lock_2 = boost::apply_visitor(getter, objects[j]))
+                    if (boost::apply_visitor(getter, objects[j]))
                     {
                         routing_object temp_1, temp_2;
-                        temp_1.value = lock_1; temp_2.value = lock_2;
-                        partition(objects, o1, o2, distance_matrix); 
+                        partition(objects, i, j, temp_1, temp_2, distance_matrix);
 
                         if (temp_1.covering_radius + temp_2.covering_radius < best_cover_radius)
                         {
-                            best = std::make_pair(temp_1, temp_2);
+                            best_1 = i;
+                            best_2 = j;
                             best_cover_radius = temp_1.covering_radius + temp_2.covering_radius;
                         }
                     }
                 }
             }
         }
-        o1 = best.first;
-        o2 = best.second;
+        //partition again with the winning pair so the children point back to the chosen nodes
+        partition(objects, best_1, best_2, o1, o2, distance_matrix);
     }
 
-    template < class T, size_t C, typename R, typename ID>
-    void m_tree<T, C, R, ID>::minimise_max_radius(const data_vector& objects, routing_object& o1, routing_object& o2)
+    template < class T, size_t C, typename R, typename ID, typename V>
+    void m_tree<T, C, R, ID, V>::minimise_max_radius(const data_vector& objects, routing_object& o1, routing_object& o2)
     {
-        std::pair<routing_object, routing_object> best;
         get_node_value getter;
         R best_cover_radius = std::numeric_limits<R>::max();
         std::vector<R> distance_matrix;
         calculate_distance_matrix(objects, distance_matrix);
+        size_t best_1 = 0, best_2 = 1;
 
         for (size_t i = 0; i < objects.size(); i++)
         {
-            if (auto lock_1 = boost::apply_visitor(getter, objects[i]))
+            if (boost::apply_visitor(getter, objects[i]))
             {
                 for (size_t j = i + 1; j < objects.size(); j++)
                 {
-                    if (auto lock_2 = boost::apply_visitor(getter, objects[j]))
+                    if (boost::apply_visitor(getter, objects[j]))
                     {
                         routing_object temp_1, temp_2;
-                        temp_1.value = lock_1; temp_2.value = lock_2;
-                        partition(objects, o1, o2, distance_matrix); 
+                        partition(objects, i, j, temp_1, temp_2, distance_matrix);
 
                         if (std::max(temp_1.covering_radius, temp_2.covering_radius) < best_cover_radius)
                         {
-                            best = std::make_pair(temp_1, temp_2);
+                            best_1 = i;
+                            best_2 = j;
                             best_cover_radius = std::max(temp_1.covering_radius, temp_2.covering_radius);
                         }
                     }
                 }
             }
         }
-        o1 = best.first;
-        o2 = best.second;
+        //partition again with the winning pair so the children point back to the chosen nodes
+        partition(objects, best_1, best_2, o1, o2, distance_matrix);
     }
 
-    template < class T, size_t C, typename R, typename ID>
-    void m_tree<T, C, R, ID>::random(const data_vector& objects, routing_object& o1, routing_object& o2)
+    template < class T, size_t C, typename R, typename ID, typename V>
+    void m_tree<T, C, R, ID, V>::random(const data_vector& objects, routing_object& o1, routing_object& o2)
+    {
+        size_t n1_index, n2_index;
+        random_indices(objects, n1_index, n2_index);
+        partition(objects, n1_index, n2_index, o1, o2);
+    }
+
+    template < class T, size_t C, typename R, typename ID, typename V>
+    void m_tree<T, C, R, ID, V>::random_indices(const data_vector& objects, size_t& n1_index, size_t& n2_index)
     {
-        get_node_value getter;
         std::default_random_engine generator;
-        std::uniform_int_distribution<int> distribution(0, objects.size() - 1);
-        int n1_index = distribution(generator);
-        int n2_index = distribution(generator);
+        std::uniform_int_distribution<size_t> distribution(0, objects.size() - 1);
+        n1_index = distribution(generator);
+        n2_index = distribution(generator);
         while (n1_index == n2_index)
         {
             n2_index = distribution(generator);
         }
-
-        o1.value = boost::apply_visitor(getter, objects[n1_index]);
-        o2.value = boost::apply_visitor(getter, objects[n2_index]);
-        partition(objects, o1, o2);
     }
 
 
-    template < class T, size_t C, typename R, typename ID>
-    void m_tree<T, C, R, ID>::sampling(const data_vector& objects, routing_object& o1, routing_object& o2)
+    template < class T, size_t C, typename R, typename ID, typename V>
+    void m_tree<T, C, R, ID, V>::sampling(const data_vector& objects, routing_object& o1, routing_object& o2)
     {
         //This sampling algorithm takes max(2, 0.1*C) samples and chooses the pair of objects that minimise 
         //the covering radius. This value was chosen as it is used in the reference literature and seems sensible
         size_t samples = static_cast<size_t>(std::max(2.0, 0.1*C));
-        std::pair<routing_object, routing_object> best_sample;
+        size_t best_1 = 0, best_2 = 1;
         R radius_sum = std::numeric_limits<R>::max();
         for (size_t i = 0; i < samples; i++)
         {
+            size_t n1_index, n2_index;
+            random_indices(objects, n1_index, n2_index);
             std::pair<routing_object, routing_object> current_sample;
-            random(objects, current_sample.first, current_sample.second);
+            partition(objects, n1_index, n2_index, current_sample.first, current_sample.second);
             if (radius_sum > (current_sample.first.covering_radius + current_sample.second.covering_radius))
             {
                 radius_sum = (current_sample.first.covering_radius + current_sample.second.covering_radius);
-                best_sample = current_sample;
+                best_1 = n1_index;
+                best_2 = n2_index;
             }
         }
-        o1 = best_sample.first;
-        o2 = best_sample.second;
+        partition(objects, best_1, best_2, o1, o2);
     }
 
 
-    template < class T, size_t C, typename R, typename ID>
-    void m_tree<T, C, R, ID>::maximise_distance_lower_bound(const data_vector& objects, routing_object& o1, routing_object& o2)
+    template < class T, size_t C, typename R, typename ID, typename V>
+    void m_tree<T, C, R, ID, V>::maximise_distance_lower_bound(const data_vector& objects, routing_object& o1, routing_object& o2)
     {
         get_node_value getter;
         double max_distance = 0.0;
+        size_t best_1 = 0, best_2 = 1;
         for (size_t i = 0; i < objects.size(); i++)
         {
             if (auto lock_1 = boost::apply_visitor(getter, objects[i]))
@@ -1014,18 +2420,18 @@ namespace mt
                         if (distance > max_distance)
                         {
                             max_distance = distance;
-                            o1.value = lock_1;
-                            o2.value = lock_2;
+                            best_1 = i;
+                            best_2 = j;
                         }
                     }
                 }
             }
         }
-        partition(objects, o1, o2);
+        partition(objects, best_1, best_2, o1, o2);
     }
 
-    template < class T, size_t C, typename R, typename ID>
-    void m_tree<T, C, R, ID>::calculate_distance_matrix(const data_vector& n, std::vector<R>& dst)
+    template < class T, size_t C, typename R, typename ID, typename V>
+    void m_tree<T, C, R, ID, V>::calculate_distance_matrix(const data_vector& n, std::vector<R>& dst)
     {
         get_node_value getter;
         dst.resize(n.size() * n.size());
@@ -1048,37 +2454,77 @@ namespace mt
         }
     }
     
-    template < class T, size_t C, typename R, typename ID>
-    std::vector<ID> m_tree<T, C, R, ID>::range_query(const T& ref, R range)
+    template < class T, size_t C, typename R, typename ID, typename V>
+    std::vector<ID> m_tree<T, C, R, ID, V>::range_query(const T& ref, R range)
+    {
+        return range_query(ref, range, id_filter());
+    }
+
+    template < class T, size_t C, typename R, typename ID, typename V>
+    std::vector<ID> m_tree<T, C, R, ID, V>::range_query(const T& ref, R range, const id_filter& filter)
+    {
+        return range_search(ref, range, filter, time_point::min(), d, nullptr);
+    }
+
+    template < class T, size_t C, typename R, typename ID, typename V>
+    std::vector<ID> m_tree<T, C, R, ID, V>::range_query(const T& ref, R range, time_point since)
+    {
+        return range_search(ref, range, id_filter(), since, d, nullptr);
+    }
+
+    template < class T, size_t C, typename R, typename ID, typename V>
+    template <class Q>
+    std::vector<ID> m_tree<T, C, R, ID, V>::range_query(const Q& ref, R range,
+        const typename query_distance_function<Q>::type& query_distance)
+    {
+        return range_search(ref, range, id_filter(), time_point::min(), query_distance, nullptr);
+    }
+
+    template < class T, size_t C, typename R, typename ID, typename V>
+    template <class Q>
+    std::vector<std::pair<ID, R>> m_tree<T, C, R, ID, V>::knn_query(const Q& ref, size_t k,
+        const typename query_distance_function<Q>::type& query_distance)
+    {
+        bool exact = false;
+        return knn_search(ref, k, std::numeric_limits<R>::max(), knn_approximation(), query_budget(), id_filter(),
+            time_point::min(), exact, query_distance);
+    }
+
+    template < class T, size_t C, typename R, typename ID, typename V>
+    std::vector<std::pair<ID, R>> m_tree<T, C, R, ID, V>::knn_query(const T& ref, size_t k, time_point since)
+    {
+        bool exact = false;
+        return knn_search(ref, k, std::numeric_limits<R>::max(), knn_approximation(), query_budget(), id_filter(),
+            since, exact, d);
+    }
+
+    template < class T, size_t C, typename R, typename ID, typename V>
+    template <class Q>
+    std::vector<ID> m_tree<T, C, R, ID, V>::range_search(const Q& ref, R range, const id_filter& filter, time_point since,
+        const std::function<R(const Q&, const T&)>& query_distance, std::vector<R>* distances)
     {
         std::vector<ID> result;
-        get_parent_value parent_getter;
-        std::vector<std::weak_ptr<tree_node>> queue;
+        //nodes still to visit and the distance from ref to the routing object of the node
+        std::vector<std::pair<std::weak_ptr<tree_node>, R>> queue;
         if (root)
-            queue.push_back(root);
+            queue.push_back(std::make_pair(std::weak_ptr<tree_node>(root), static_cast<R>(0)));
         while (false == queue.empty())
         {
-            if (auto locked = queue[0].lock())
+            if (auto locked = queue[0].first.lock())
             {
-                //implement a distance to parent function here
-                R dist_to_parent = 0;
-                std::shared_ptr<T> parent_value = boost::apply_visitor(parent_getter, locked->data);
-                if (parent_value && (false == locked->parent.expired()))
-                    dist_to_parent = d(ref, *parent_value);
+                R dist_to_parent = queue[0].second;
                 if (locked->internal_node())
                 {
                     route_set& ros = boost::get<route_set>(locked->data);
                     for (size_t i = 0; i < C; i++)
                     {
-                        if (auto temp_lock = ros[i].value.lock())
+                        if (const T* temp_lock = ros[i].value.get())
                         {
-                            if (std::abs(dist_to_parent - ros[i].distance) <= range + ros[i].covering_radius)
+                            if (ros[i].newest >= since && std::abs(dist_to_parent - ros[i].distance) <= range + ros[i].covering_radius)
                             {
-                                R distance = std::numeric_limits<R>::max();
-                                if (auto v = ros[i].value.lock())
-                                    distance = d(ref, *v);
-                                if (distance < range + ros[i].covering_radius)
-                                    queue.push_back(ros[i].covering_tree);
+                                R distance = query_distance(ref, *temp_lock);
+                                if (distance <= range + ros[i].covering_radius)
+                                    queue.push_back(std::make_pair(std::weak_ptr<tree_node>(ros[i].covering_tree), distance));
                             }
                         }
                     }
@@ -1088,12 +2534,17 @@ namespace mt
                     leaf_set& los = boost::get<leaf_set>(locked->data);
                     for (size_t i = 0; i < C; i++)
                     {
-                        if (los[i].value)
+                        if (los[i].value && los[i].timestamp >= since && (!filter || filter(los[i].id)))
                         {
-                            if (std::abs(dist_to_parent - los[i].distance) < range)
+                            if (std::abs(dist_to_parent - los[i].distance) <= range)
                             {
-                                if (d(*los[i].value, ref) <= range)
+                                R distance = query_distance(ref, *los[i].value);
+                                if (distance <= range)
+                                {
                                     result.push_back(los[i].id);
+                                    if (distances)
+                                        distances->push_back(distance);
+                                }
                             }
                         }
                     }
@@ -1104,151 +2555,1706 @@ namespace mt
         return result;
     }
 
-    template < class T, size_t C, typename R, typename ID>
-    std::vector<std::pair<ID, R>> m_tree<T, C, R, ID>::knn_query(const T& ref, size_t k)
+    template < class T, size_t C, typename R, typename ID, typename V>
+    size_t m_tree<T, C, R, ID, V>::range_count(const T& ref, R range)
     {
-        BOOST_ASSERT_MSG(k > 0, "knn_query: 0 neighbours is invalid");
-        auto choose_node = [](const std::pair<R, std::weak_ptr<tree_node>>& a, 
-            const std::pair<R, std::weak_ptr<tree_node>>& b)
-        {
-            return a.first < b.first;
-        };
-        std::pair<ID, R> res_init;
-        res_init.second = std::numeric_limits<R>::max();
-        std::vector<std::pair<ID, R>> result;// (k, res_init);
-        std::vector<std::pair<R, std::weak_ptr<tree_node>>> queue;
+        /*
+            Subtrees whose ball lies entirely within range add their object count without being visited.
+            Below the root d(ref, o) <= d(ref, parent) + d(parent, o) so this can often be decided without
+            computing the distance to the routing object.
+            */
+        size_t result = 0;
+        std::vector<std::pair<std::weak_ptr<tree_node>, R>> queue;
         if (root)
+            queue.push_back(std::make_pair(std::weak_ptr<tree_node>(root), static_cast<R>(0)));
+        while (false == queue.empty())
         {
-            queue.push_back(std::make_pair(static_cast<R>(0), root));
+            if (auto locked = queue.back().first.lock())
+            {
+                R dist_to_parent = queue.back().second;
+                bool has_parent = locked != root;
+                queue.pop_back();
+                if (locked->internal_node())
+                {
+                    route_set& ros = boost::get<route_set>(locked->data);
+                    for (size_t i = 0; i < C; i++)
+                    {
+                        if (const T* temp_lock = ros[i].value.get())
+                        {
+                            if (std::abs(dist_to_parent - ros[i].distance) > range + ros[i].covering_radius)
+                                continue;
+                            if (has_parent && dist_to_parent + ros[i].distance + ros[i].covering_radius <= range)
+                            {
+                                result += ros[i].count;
+                                continue;
+                            }
+                            R distance = d(ref, *temp_lock);
+                            if (distance + ros[i].covering_radius <= range)
+                                result += ros[i].count;
+                            else if (distance <= range + ros[i].covering_radius)
+                                queue.push_back(std::make_pair(std::weak_ptr<tree_node>(ros[i].covering_tree), distance));
+                        }
+                    }
+                }
+                else if (locked->leaf_node())
+                {
+                    leaf_set& los = boost::get<leaf_set>(locked->data);
+                    for (size_t i = 0; i < C; i++)
+                    {
+                        if (los[i].value)
+                        {
+                            if (std::abs(dist_to_parent - los[i].distance) > range)
+                                continue;
+                            if ((has_parent && dist_to_parent + los[i].distance <= range) ||
+                                d(*los[i].value, ref) <= range)
+                                result++;
+                        }
+                    }
+                }
+            }
+            else
+            {
+                queue.pop_back();
+            }
         }
+        return result;
+    }
 
-        while (false == queue.empty())
+    template < class T, size_t C, typename R, typename ID, typename V>
+    std::vector<ID> m_tree<T, C, R, ID, V>::sample(size_t n)
+    {
+        std::vector<ID> result;
+        if (!root || 0 == tree_size)
+            return result;
+        result.reserve(n);
+        for (size_t i = 0; i < n; i++)
         {
-            auto current = std::min_element(std::begin(queue), std::end(queue), choose_node);
-            auto node = current->second;
-            queue.erase(current);
-            knn_node_search(ref, node.lock(), k, queue, result);
+            result.push_back(sample_subtree(root));
         }
-        for (int i = 0; i < result.size(); i++)
+        return result;
+    }
+
+    template < class T, size_t C, typename R, typename ID, typename V>
+    std::vector<ID> m_tree<T, C, R, ID, V>::sample_in_range(const T& ref, R range, size_t n)
+    {
+        /*
+            The objects within range are split up as in range_count: whole subtrees inside the query ball
+            weighted by their count, and single leaf objects weighted one. A piece is picked by weight and
+            subtrees are then sampled by descending them, so every object in range is equally likely.
+            */
+        std::vector<ID> result;
+        std::vector<std::shared_ptr<tree_node>> subtrees;
+        std::vector<ID> objects;
+        std::vector<double> weights;
+        std::vector<std::pair<std::weak_ptr<tree_node>, R>> queue;
+        if (root)
+            queue.push_back(std::make_pair(std::weak_ptr<tree_node>(root), static_cast<R>(0)));
+        while (false == queue.empty())
         {
-            if (result[i].first == ID())
+            std::shared_ptr<tree_node> locked = queue.back().first.lock();
+            R dist_to_parent = queue.back().second;
+            queue.pop_back();
+            if (!locked)
+                continue;
+            bool has_parent = locked != root;
+            if (locked->internal_node())
+            {
+                route_set& ros = boost::get<route_set>(locked->data);
+                for (size_t i = 0; i < C; i++)
+                {
+                    if (const T* temp_lock = ros[i].value.get())
+                    {
+                        if (std::abs(dist_to_parent - ros[i].distance) > range + ros[i].covering_radius)
+                            continue;
+                        bool inside = has_parent && dist_to_parent + ros[i].distance + ros[i].covering_radius <= range;
+                        R distance = static_cast<R>(0);
+                        if (false == inside)
+                        {
+                            distance = d(ref, *temp_lock);
+                            inside = distance + ros[i].covering_radius <= range;
+                        }
+                        if (inside)
+                        {
+                            subtrees.push_back(ros[i].covering_tree);
+                            weights.push_back(static_cast<double>(ros[i].count));
+                        }
+                        else if (distance <= range + ros[i].covering_radius)
+                        {
+                            queue.push_back(std::make_pair(std::weak_ptr<tree_node>(ros[i].covering_tree), distance));
+                        }
+                    }
+                }
+            }
+            else if (locked->leaf_node())
             {
-                result.erase(std::begin(result) + i);
-                i--;
+                for (const leaf_object& leaf : boost::get<leaf_set>(locked->data))
+                {
+                    if (leaf.value && std::abs(dist_to_parent - leaf.distance) <= range)
+                    {
+                        if ((has_parent && dist_to_parent + leaf.distance <= range) || d(*leaf.value, ref) <= range)
+                        {
+                            objects.push_back(leaf.id);
+                        }
+                    }
+                }
             }
         }
-        if (result.size() > k)
+        if (subtrees.empty() && objects.empty())
+            return result;
+        //single objects are weighted after all the subtrees
+        weights.resize(subtrees.size() + objects.size(), 1.0);
+
+        std::discrete_distribution<size_t> pieces(std::begin(weights), std::end(weights));
+        result.reserve(n);
+        for (size_t i = 0; i < n; i++)
         {
-            result.erase(std::begin(result) + k, std::end(result));
+            size_t piece = pieces(generator);
+            if (piece < subtrees.size())
+                result.push_back(sample_subtree(subtrees[piece]));
+            else
+                result.push_back(objects[piece - subtrees.size()]);
         }
         return result;
     }
 
-    template < class T, size_t C, typename R, typename ID>
-    void m_tree<T, C, R, ID>::nn_list_update(const std::pair<ID, R>& in, size_t k, std::vector<std::pair<ID, R>>& result)
+    template < class T, size_t C, typename R, typename ID, typename V>
+    ID m_tree<T, C, R, ID, V>::sample_subtree(std::shared_ptr<tree_node> node)
     {
-        auto sort_result = [](const std::pair<ID, R>& a, const std::pair<ID, R>& b)
-        {
-            return a.second < b.second ;
-        };
-        bool inserted = false;
-        for (auto& p:result)
+        while (node && node->internal_node())
         {
-            if (p.first == ID() && p.second == in.second)
+            route_set& ros = boost::get<route_set>(node->data);
+            get_object_count count_getter;
+            size_t total = count_getter(ros);
+            std::uniform_int_distribution<size_t> distribution(0, total - 1);
+            size_t pick = distribution(generator);
+            std::shared_ptr<tree_node> next;
+            for (const routing_object& ro : ros)
             {
-                p.first = in.first;
-                inserted = true;
-                break;
+                if (!ro.covering_tree)
+                    continue;
+                if (pick < ro.count)
+                {
+                    next = ro.covering_tree;
+                    break;
+                }
+                pick -= ro.count;
             }
+            node = next;
         }
-        if (false == inserted)
-            result.push_back(in);
-        
-        std::sort(std::begin(result), std::end(result), sort_result);
-
-        if(result.size()>k)
+        BOOST_ASSERT_MSG(node, "sample_subtree: subtree counts are inconsistent");
+        leaf_set& los = boost::get<leaf_set>(node->data);
+        std::vector<size_t> present;
+        for (size_t i = 0; i < C; i++)
         {
-            result.erase(std::begin(result) + k, std::end(result));
-        }       
+            if (los[i].value)
+                present.push_back(i);
+        }
+        std::uniform_int_distribution<size_t> distribution(0, present.size() - 1);
+        return los[present[distribution(generator)]].id;
     }
 
-    template < class T, size_t C, typename R, typename ID>
-    void m_tree<T, C, R, ID>::knn_node_search(const T& ref, std::shared_ptr<tree_node> current, size_t k,
-        std::vector<std::pair<R, std::weak_ptr<tree_node>>>& queue, std::vector<std::pair<ID, R>>& result)
+    template < class T, size_t C, typename R, typename ID, typename V>
+    void m_tree<T, C, R, ID, V>::similarity_join(const m_tree& other, R range, const pair_callback& callback, size_t threads) const
     {
-        using namespace std::placeholders;
-        if (false == current)
+        if (!root || !other.root)
+            return;
+        join_task start;
+        start.a.node = root;
+        start.b.node = other.root;
+        start.self = root == other.root;
+        join(start, range, callback, threads);
+    }
+
+    template < class T, size_t C, typename R, typename ID, typename V>
+    void m_tree<T, C, R, ID, V>::self_join(R range, const pair_callback& callback, size_t threads) const
+    {
+        if (!root)
             return;
+        join_task start;
+        start.a.node = root;
+        start.b.node = root;
+        start.self = true;
+        join(start, range, callback, threads);
+    }
 
-        
-        auto remove_node = [](const std::pair<R, std::weak_ptr<tree_node>>& a, R threshold)
+    template < class T, size_t C, typename R, typename ID, typename V>
+    void m_tree<T, C, R, ID, V>::join(const join_task& start, R range, const pair_callback& callback, size_t threads,
+        const join_filter& filter) const
+    {
+        std::vector<join_task> frontier(1, start);
+        if (threads > 1)
+        {
+            //expand the top of both trees until there are enough independent subtree pairs to share out
+            bool expanded = true;
+            while (expanded && frontier.size() < 16 * threads)
+            {
+                expanded = false;
+                std::vector<join_task> next;
+                for (const join_task& task : frontier)
+                {
+                    if (task.a.node->leaf_node() && task.b.node->leaf_node())
+                    {
+                        next.push_back(task);
+                    }
+                    else
+                    {
+                        join_step(task, range, callback, next, filter);
+                        expanded = true;
+                    }
+                }
+                frontier.swap(next);
+            }
+        }
+        std::atomic<size_t> next_task(0);
+        auto worker = [&]()
         {
-            return a.first > threshold;
+            std::vector<join_task> pending;
+            for (size_t i = next_task++; i < frontier.size(); i = next_task++)
+            {
+                pending.push_back(frontier[i]);
+                while (false == pending.empty())
+                {
+                    join_task task = pending.back();
+                    pending.pop_back();
+                    join_step(task, range, callback, pending, filter);
+                }
+            }
         };
+        std::vector<std::thread> workers;
+        for (size_t i = 1; i < std::min(threads, frontier.size()); i++)
+        {
+            workers.push_back(std::thread(worker));
+        }
+        worker();
+        for (std::thread& w : workers)
+        {
+            w.join();
+        }
+    }
+
+    template < class T, size_t C, typename R, typename ID, typename V>
+    void m_tree<T, C, R, ID, V>::join_step(const join_task& task, R range, const pair_callback& callback,
+        std::vector<join_task>& pending, const join_filter& filter) const
+    {
+        /*
+            Pairs of subtrees are discarded when d(center_a, center_b) > radius_a + radius_b + range. Before
+            computing that distance |d(center_a, center_b) - d(center_b, child)| is used as a lower bound
+            for the distance between the child of the expanded side and the other center.
+            */
+        if (filter && false == filter(task))
+            return;
+        const tree_node& a = *task.a.node;
+        const tree_node& b = *task.b.node;
+        if (a.leaf_node() && b.leaf_node())
+        {
+            join_leaves(task, range, callback);
+            return;
+        }
+        if (task.self)
+        {
+            const route_set& routers = boost::get<route_set>(a.data);
+            for (size_t i = 0; i < C; i++)
+            {
+                const T* ci = routers[i].value.get();
+                if (!ci)
+                    continue;
+                for (size_t j = i; j < C; j++)
+                {
+                    const T* cj = routers[j].value.get();
+                    if (!cj)
+                        continue;
+                    join_task child;
+                    child.a.node = routers[i].covering_tree;
+                    child.a.center = ci;
+                    child.a.radius = routers[i].covering_radius;
+                    child.b.node = routers[j].covering_tree;
+                    child.b.center = cj;
+                    child.b.radius = routers[j].covering_radius;
+                    child.self = i == j;
+                    if (i != j)
+                    {
+                        if (std::abs(routers[i].distance - routers[j].distance) > child.a.radius + child.b.radius + range)
+                            continue;
+                        child.center_distance = d(*ci, *cj);
+                        if (child.center_distance > child.a.radius + child.b.radius + range)
+                            continue;
+                    }
+                    pending.push_back(child);
+                }
+            }
+            return;
+        }
+        //expand the internal node, or the larger of the two when both are internal
+        bool expand_a = a.internal_node() && (b.leaf_node() || task.a.radius >= task.b.radius);
+        const join_side& expanded = expand_a ? task.a : task.b;
+        const join_side& fixed = expand_a ? task.b : task.a;
+        bool known = expanded.center && fixed.center;
+        for (const routing_object& ro : boost::get<route_set>(expanded.node->data))
+        {
+            const T* center = ro.value.get();
+            if (!center)
+                continue;
+            join_side side;
+            side.node = ro.covering_tree;
+            side.center = center;
+            side.radius = ro.covering_radius;
+            join_task child;
+            if (fixed.center)
+            {
+                if (known && std::abs(task.center_distance - ro.distance) > side.radius + fixed.radius + range)
+                    continue;
+                child.center_distance = d(*center, *fixed.center);
+                if (child.center_distance > side.radius + fixed.radius + range)
+                    continue;
+            }
+            child.a = expand_a ? side : fixed;
+            child.b = expand_a ? fixed : side;
+            pending.push_back(child);
+        }
+    }
 
-        R dp = static_cast<R>(0);
-        get_parent_value getter;
-        std::shared_ptr<T> parent_value = boost::apply_visitor(getter, current->data);
-        if (parent_value && (false == current->parent.expired()))
-            dp = d(*parent_value, ref);
+    template < class T, size_t C, typename R, typename ID, typename V>
+    void m_tree<T, C, R, ID, V>::join_leaves(const join_task& task, R range, const pair_callback& callback) const
+    {
+        const leaf_set& a = boost::get<leaf_set>(task.a.node->data);
+        const leaf_set& b = boost::get<leaf_set>(task.b.node->data);
+        bool known = task.a.center && task.b.center;
+        for (size_t i = 0; i < C; i++)
+        {
+            if (!a[i].value)
+                continue;
+            //distance from a[i] to the center of b, b's entries store their own distance to it
+            R to_center = static_cast<R>(0);
+            if (task.self)
+            {
+                to_center = a[i].distance;
+            }
+            else if (task.b.center)
+            {
+                if (known && std::abs(task.center_distance - a[i].distance) > task.b.radius + range)
+                    continue;
+                to_center = d(*a[i].value, *task.b.center);
+                if (to_center > task.b.radius + range)
+                    continue;
+            }
+            for (size_t j = task.self ? i + 1 : 0; j < C; j++)
+            {
+                if (!b[j].value)
+                    continue;
+                if (task.b.center && std::abs(to_center - b[j].distance) > range)
+                    continue;
+                R distance = d(*a[i].value, *b[j].value);
+                if (distance <= range)
+                    callback(a[i].id, b[j].id, distance);
+            }
+        }
+    }
 
-        R dk = std::numeric_limits<R>::max();
-        if (false == result.empty())
-            dk = result.back().second;
+    template < class T, size_t C, typename R, typename ID, typename V>
+    std::map<ID, int> m_tree<T, C, R, ID, V>::dbscan(R eps, size_t min_pts, size_t threads) const
+    {
+        /*
+            From "A Density-Based Algorithm for Discovering Clusters in Large Spatial Databases with Noise"
+            (M. Ester, H. Kriegel, J. Sander, X. Xu). Rather than one range query per object the eps
+            neighbourhoods come from a single self join.
 
-        if (current->internal_node())
+            A subtree with a diameter (twice its covering radius) of at most eps holding min_pts objects or
+            more is dense: its objects are all core objects of one cluster, so it is never joined with
+            itself. Pairs of core objects are merged with a union-find shared by the threads, border objects
+            join the cluster of a core object next to them.
+            */
+        std::map<ID, int> labels;
+        std::vector<std::shared_ptr<tree_node>> leaves;
+        collect_leaves(root, leaves);
+        std::map<ID, size_t> index;
+        std::vector<ID> ids;
+        for (const std::shared_ptr<tree_node>& leaf : leaves)
         {
-            route_set& set = boost::get<route_set>(current->data);
-            for (const routing_object& ro : set)
+            for (const leaf_object& lo : boost::get<leaf_set>(leaf->data))
+            {
+                if (lo.value && index.insert(std::make_pair(lo.id, ids.size())).second)
+                    ids.push_back(lo.id);
+            }
+        }
+        size_t n = ids.size();
+        std::vector<std::atomic<size_t>> sets(n);
+        std::vector<std::atomic<size_t>> neighbours(n);
+        for (size_t i = 0; i < n; i++)
+        {
+            sets[i] = i;
+            neighbours[i] = 1;
+        }
+
+        //dense subtrees, the topmost ones only
+        std::vector<char> core(n, 0);
+        std::vector<const tree_node*> dense;
+        std::vector<std::shared_ptr<tree_node>> queue;
+        if (root && root->internal_node())
+            queue.push_back(root);
+        while (false == queue.empty())
+        {
+            std::shared_ptr<tree_node> node = queue.back();
+            queue.pop_back();
+            for (const routing_object& ro : boost::get<route_set>(node->data))
             {
-                if ((false==ro.value.expired()) && 
-                    (std::abs(dp - ro.distance) <= dk + ro.covering_radius))
+                if (!ro.covering_tree)
+                    continue;
+                if (2 * ro.covering_radius <= eps && ro.count >= min_pts)
                 {
-                    R value_distance = d(*ro.value.lock(), ref);
-                    R dmin = std::max(value_distance - ro.covering_radius, static_cast<R>(0));
-                    
-                    if (dmin <= dk)
+                    dense.push_back(ro.covering_tree.get());
+                    std::vector<std::shared_ptr<tree_node>> members;
+                    collect_leaves(ro.covering_tree, members);
+                    size_t first = n;
+                    for (const std::shared_ptr<tree_node>& leaf : members)
                     {
-                        queue.push_back(std::make_pair(dmin, ro.covering_tree));
-                        R dmax = value_distance + ro.covering_radius;
-                        if (dmax < dk)
+                        for (const leaf_object& lo : boost::get<leaf_set>(leaf->data))
                         {
-                            std::pair<ID, R> queue_value;
-                            queue_value.second = dmax;
-                            nn_list_update(queue_value, k, result);
-                            dk = result.back().second;
-                            auto it = std::remove_if(std::begin(queue), std::end(queue), std::bind(remove_node, _1, dk));
-                            if (it != std::end(queue))
-                                queue.erase(it);
+                            if (!lo.value)
+                                continue;
+                            size_t i = index[lo.id];
+                            core[i] = 1;
+                            if (first == n)
+                                first = i;
+                            unite_sets(sets, first, i);
                         }
                     }
                 }
+                else if (ro.covering_tree->internal_node())
+                {
+                    queue.push_back(ro.covering_tree);
+                }
             }
         }
-        else if (current->leaf_node())
+        std::sort(std::begin(dense), std::end(dense));
+
+        std::vector<std::pair<size_t, size_t>> edges;
+        std::mutex edge_lock;
+        pair_callback collect = [&](const ID& a, const ID& b, R)
         {
-            leaf_set& set = boost::get<leaf_set>(current->data);
-            for (const leaf_object& leaf : set)
+            size_t i = index.find(a)->second;
+            size_t j = index.find(b)->second;
+            neighbours[i]++;
+            neighbours[j]++;
+            std::lock_guard<std::mutex> guard(edge_lock);
+            edges.push_back(std::make_pair(i, j));
+        };
+        join_filter skip_dense = [&](const join_task& task)
+        {
+            return false == task.self || false == std::binary_search(std::begin(dense), std::end(dense), task.a.node.get());
+        };
+        if (root)
+        {
+            join_task start;
+            start.a.node = root;
+            start.b.node = root;
+            start.self = true;
+            join(start, eps, collect, threads, skip_dense);
+        }
+        for (size_t i = 0; i < n; i++)
+        {
+            if (neighbours[i] >= min_pts)
+                core[i] = 1;
+        }
+
+        //core pairs are merged in parallel, then border objects take the cluster of a core neighbour
+        std::vector<size_t> border(n, n);
+        std::atomic<size_t> next_block(0);
+        const size_t block = 4096;
+        auto worker = [&]()
+        {
+            for (size_t b = next_block++; b * block < edges.size(); b = next_block++)
             {
-                if (leaf.value && std::abs(dp - leaf.distance) <= dk)
+                for (size_t e = b * block; e < std::min(edges.size(), (b + 1) * block); e++)
                 {
-                    R value_distance = d(*leaf.value, ref);
-                    if (value_distance <= dk)
-                    {
-                        nn_list_update(std::make_pair(leaf.id, value_distance), k, result);
-                        dk = result.back().second;
-                        auto it = std::remove_if(std::begin(queue), std::end(queue), std::bind(remove_node, _1, dk));
-                        if (it != std::end(queue))
-                            queue.erase(it);
-                    }
+                    if (core[edges[e].first] && core[edges[e].second])
+                        unite_sets(sets, edges[e].first, edges[e].second);
                 }
             }
+        };
+        std::vector<std::thread> workers;
+        for (size_t i = 1; i < std::min(threads, edges.size() / block + 1); i++)
+        {
+            workers.push_back(std::thread(worker));
+        }
+        worker();
+        for (std::thread& w : workers)
+        {
+            w.join();
         }
+        for (const std::pair<size_t, size_t>& edge : edges)
+        {
+            if (core[edge.first] && false == core[edge.second] && border[edge.second] == n)
+                border[edge.second] = edge.first;
+            else if (core[edge.second] && false == core[edge.first] && border[edge.first] == n)
+                border[edge.first] = edge.second;
+        }
+
+        std::vector<int> cluster(n, -1);
+        int clusters = 0;
+        for (size_t i = 0; i < n; i++)
+        {
+            size_t owner = core[i] ? i : border[i];
+            if (owner == n)
+                continue;
+            size_t set = find_set(sets, owner);
+            if (cluster[set] < 0)
+                cluster[set] = clusters++;
+            labels[ids[i]] = cluster[set];
+        }
+        for (size_t i = 0; i < n; i++)
+        {
+            labels.insert(std::make_pair(ids[i], -1));
+        }
+        return labels;
     }
 
+    template < class T, size_t C, typename R, typename ID, typename V>
+    std::vector<std::pair<ID, R>> m_tree<T, C, R, ID, V>::knn_outliers(size_t k, size_t n, size_t threads) const
+    {
+        /*
+            Pruning as in "Mining Distance-Based Outliers in Near Linear Time with Randomization and a Simple
+            Pruning Rule" (S. Bay, M. Schwabacher). The cutoff is the n-th highest score found so far, a
+            search stops as soon as the object's k-th neighbour is closer than it. Objects are searched a
+            leaf at a time as in all_knn, leaves with the widest routing objects first so the cutoff rises
+            quickly.
+
+            A subtree holding more than k objects within a diameter (twice its covering radius) below the
+            cutoff can't contain an outlier: every object in it has k neighbours closer than the cutoff.
+            */
+        BOOST_ASSERT_MSG(k > 0, "knn_outliers: 0 neighbours is invalid");
+        std::vector<std::pair<ID, R>> result;
+        //no object has k neighbours when the tree holds k objects or fewer
+        if (0 == n || 0 == k || k >= size())
+            return result;
+        std::vector<std::shared_ptr<tree_node>> leaves;
+        collect_leaves(root, leaves);
+        if (leaves.empty())
+            return result;
+        //the routing object of each node, none for the root
+        auto router = [](const std::shared_ptr<tree_node>& node) -> const routing_object*
+        {
+            if (auto parent = node->parent.lock())
+            {
+                for (const routing_object& ro : boost::get<route_set>(parent->data))
+                {
+                    if (ro.covering_tree == node)
+                        return &ro;
+                }
+            }
+            return nullptr;
+        };
+        std::stable_sort(std::begin(leaves), std::end(leaves), [&](const std::shared_ptr<tree_node>& a, const std::shared_ptr<tree_node>& b)
+        {
+            const routing_object* ra = router(a);
+            const routing_object* rb = router(b);
+            return ra && rb && ra->covering_radius > rb->covering_radius;
+        });
+
+        std::mutex result_lock;
+        auto farther = [](const std::pair<ID, R>& a, const std::pair<ID, R>& b)
+        {
+            return a.second > b.second;
+        };
+        auto cutoff = [&]()
+        {
+            std::lock_guard<std::mutex> guard(result_lock);
+            return result.size() < n ? static_cast<R>(0) : result.back().second;
+        };
+        std::atomic<size_t> next_leaf(0);
+        auto worker = [&]()
+        {
+            for (size_t l = next_leaf++; l < leaves.size(); l = next_leaf++)
+            {
+                R floor = cutoff();
+                bool dense = false;
+                for (std::shared_ptr<tree_node> node = leaves[l]; node && false == dense; node = node->parent.lock())
+                {
+                    const routing_object* ro = router(node);
+                    dense = ro && ro->count > k && 2 * ro->covering_radius < floor;
+                }
+                if (dense)
+                    continue;
+                std::vector<const leaf_object*> queries;
+                std::vector<R> center_distances;
+                const T* center = leaf_queries(leaves[l], queries, center_distances);
+                if (queries.empty())
+                    continue;
+                std::vector<std::vector<nn_entry>> found;
+                knn_batch(queries, *center, center_distances, k, true, floor, found);
+                std::lock_guard<std::mutex> guard(result_lock);
+                for (size_t i = 0; i < queries.size(); i++)
+                {
+                    std::pair<ID, R> scored(queries[i]->id, found[i].back().distance);
+                    if (result.size() < n || scored.second > result.back().second)
+                    {
+                        result.insert(std::upper_bound(std::begin(result), std::end(result), scored, farther), scored);
+                        if (result.size() > n)
+                            result.pop_back();
+                    }
+                }
+            }
+        };
+        std::vector<std::thread> workers;
+        for (size_t i = 1; i < std::min(threads, leaves.size()); i++)
+        {
+            workers.push_back(std::thread(worker));
+        }
+        worker();
+        for (std::thread& w : workers)
+        {
+            w.join();
+        }
+        return result;
+    }
+
+    template < class T, size_t C, typename R, typename ID, typename V>
+    size_t m_tree<T, C, R, ID, V>::find_set(std::vector<std::atomic<size_t>>& sets, size_t x)
+    {
+        //path halving, a failed exchange only means another thread already shortened the path
+        size_t parent = sets[x];
+        while (parent != x)
+        {
+            size_t grandparent = sets[parent];
+            sets[x].compare_exchange_weak(parent, grandparent);
+            x = parent;
+            parent = sets[x];
+        }
+        return x;
+    }
+
+    template < class T, size_t C, typename R, typename ID, typename V>
+    void m_tree<T, C, R, ID, V>::unite_sets(std::vector<std::atomic<size_t>>& sets, size_t a, size_t b)
+    {
+        while (true)
+        {
+            a = find_set(sets, a);
+            b = find_set(sets, b);
+            if (a == b)
+                return;
+            if (a < b)
+                std::swap(a, b);
+            //a is a root as long as the exchange succeeds, otherwise retry from the new roots
+            size_t expected = a;
+            if (sets[a].compare_exchange_strong(expected, b))
+                return;
+        }
+    }
+
+    template < class T, size_t C, typename R, typename ID, typename V>
+    typename m_tree<T, C, R, ID, V>::knn_graph m_tree<T, C, R, ID, V>::all_knn(size_t k, size_t threads) const
+    {
+        BOOST_ASSERT_MSG(k > 0, "all_knn: 0 neighbours is invalid");
+        return knn_leaves(*this, k, true, threads);
+    }
+
+    template < class T, size_t C, typename R, typename ID, typename V>
+    typename m_tree<T, C, R, ID, V>::knn_graph m_tree<T, C, R, ID, V>::knn_join(const m_tree& reference, size_t k, size_t threads) const
+    {
+        BOOST_ASSERT_MSG(k > 0, "knn_join: 0 neighbours is invalid");
+        return knn_leaves(reference, k, false, threads);
+    }
+
+    template < class T, size_t C, typename R, typename ID, typename V>
+    typename m_tree<T, C, R, ID, V>::knn_graph m_tree<T, C, R, ID, V>::knn_leaves(const m_tree& reference, size_t k,
+        bool exclude_self, size_t threads) const
+    {
+        std::vector<std::shared_ptr<tree_node>> leaves;
+        collect_leaves(root, leaves);
+        std::vector<size_t> first_object(leaves.size() + 1, 0);
+        for (size_t i = 0; i < leaves.size(); i++)
+        {
+            get_object_count count_getter;
+            first_object[i + 1] = first_object[i] + boost::apply_visitor(count_getter, leaves[i]->data);
+        }
+        std::vector<ID> ids(first_object.back());
+        std::vector<std::vector<nn_entry>> rows(first_object.back());
+
+        std::atomic<size_t> next_leaf(0);
+        auto worker = [&]()
+        {
+            for (size_t l = next_leaf++; l < leaves.size(); l = next_leaf++)
+            {
+                std::vector<const leaf_object*> queries;
+                std::vector<R> center_distances;
+                const T* center = leaf_queries(leaves[l], queries, center_distances);
+                std::vector<std::vector<nn_entry>> found;
+                reference.knn_batch(queries, *center, center_distances, k, exclude_self, static_cast<R>(0), found);
+                for (size_t i = 0; i < queries.size(); i++)
+                {
+                    ids[first_object[l] + i] = queries[i]->id;
+                    rows[first_object[l] + i].swap(found[i]);
+                }
+            }
+        };
+        std::vector<std::thread> workers;
+        for (size_t i = 1; i < std::min(threads, leaves.size()); i++)
+        {
+            workers.push_back(std::thread(worker));
+        }
+        worker();
+        for (std::thread& w : workers)
+        {
+            w.join();
+        }
+        return make_knn_graph(ids, rows);
+    }
+
+    template < class T, size_t C, typename R, typename ID, typename V>
+    const T* m_tree<T, C, R, ID, V>::leaf_queries(std::shared_ptr<tree_node> leaf, std::vector<const leaf_object*>& queries,
+        std::vector<R>& center_distances) const
+    {
+        for (const leaf_object& lo : boost::get<leaf_set>(leaf->data))
+        {
+            if (lo.value)
+            {
+                queries.push_back(&lo);
+                center_distances.push_back(lo.distance);
+            }
+        }
+        const T* center = routing_value(leaf);
+        if (!center && false == queries.empty())
+        {
+            //a root leaf has no routing object, its first object stands in
+            center = queries[0]->value.get();
+            for (size_t i = 0; i < queries.size(); i++)
+            {
+                center_distances[i] = d(*center, *queries[i]->value);
+            }
+        }
+        return center;
+    }
+
+    template < class T, size_t C, typename R, typename ID, typename V>
+    void m_tree<T, C, R, ID, V>::knn_batch(const std::vector<const leaf_object*>& queries, const T& center,
+        const std::vector<R>& center_distances, size_t k, bool exclude_self, R cutoff, std::vector<std::vector<nn_entry>>& results) const
+    {
+        /*
+            Nearest neighbours of a group of queries close to each other (the objects of a leaf) found with
+            a single traversal. Only the distance from the group's center c to each routing object is
+            computed, d(q, router) >= |d(c, router) - d(c, q)| bounds every query at once. A node is expanded
+            while any query could still find a neighbour in it, in leaves the same bound through the entry's
+            distance to its router skips most object pairs.
+
+            With exclude_self queries are objects of this tree and are not reported as their own neighbour.
+            A query stops being searched once its k-th neighbour is closer than cutoff, leaving its result
+            incomplete.
+            */
+        size_t n = queries.size();
+        results.assign(n, std::vector<nn_entry>());
+        if (!root || 0 == n)
+            return;
+        R query_radius = *std::max_element(std::begin(center_distances), std::end(center_distances));
+        std::vector<R> dk(n, std::numeric_limits<R>::max());
+        std::vector<char> active(n, 1);
+        auto bound = [&](R center_distance, R radius, size_t i)
+        {
+            R gap = std::abs(center_distance - center_distances[i]);
+            return gap > radius ? gap - radius : static_cast<R>(0);
+        };
+        //nodes closest to the center first so the queries' own leaf seeds the bounds
+        auto choose_node = [](const knn_entry& a, const knn_entry& b)
+        {
+            return a.dmin < b.dmin || (a.dmin == b.dmin && a.parent_distance < b.parent_distance);
+        };
+        std::vector<knn_entry> queue;
+        std::vector<R> radii;
+        std::vector<size_t> candidates;
+        knn_entry root_entry;
+        root_entry.node = root;
+        queue.push_back(root_entry);
+        radii.push_back(std::numeric_limits<R>::max());
+
+        while (false == queue.empty())
+        {
+            size_t current = std::distance(std::begin(queue), std::min_element(std::begin(queue), std::end(queue), choose_node));
+            knn_entry entry = queue[current];
+            R radius = radii[current];
+            queue.erase(std::begin(queue) + current);
+            radii.erase(std::begin(radii) + current);
+            std::shared_ptr<tree_node> node = entry.node.lock();
+            bool known = node != root;
+            if (!node || entry.dmin > *std::max_element(std::begin(dk), std::end(dk)))
+                continue;
+            if (known)
+            {
+                bool useful = false;
+                for (size_t i = 0; i < n && false == useful; i++)
+                {
+                    useful = active[i] && bound(entry.parent_distance, radius, i) <= dk[i];
+                }
+                if (false == useful)
+                    continue;
+            }
+
+            if (node->internal_node())
+            {
+                for (const routing_object& ro : boost::get<route_set>(node->data))
+                {
+                    const T* value = ro.value.get();
+                    if (!value)
+                        continue;
+                    if (known && std::abs(entry.parent_distance - ro.distance) > ro.covering_radius + query_radius &&
+                        std::abs(entry.parent_distance - ro.distance) - ro.covering_radius - query_radius >
+                        *std::max_element(std::begin(dk), std::end(dk)))
+                        continue;
+                    knn_entry child;
+                    child.parent_distance = d(center, *value);
+                    child.dmin = std::numeric_limits<R>::max();
+                    for (size_t i = 0; i < n; i++)
+                    {
+                        R lower = bound(child.parent_distance, ro.covering_radius, i);
+                        if (active[i] && lower <= dk[i])
+                            child.dmin = std::min(child.dmin, lower);
+                    }
+                    if (child.dmin == std::numeric_limits<R>::max())
+                        continue;
+                    child.node = ro.covering_tree;
+                    queue.push_back(child);
+                    radii.push_back(ro.covering_radius);
+                }
+            }
+            else if (node->leaf_node())
+            {
+                for (const leaf_object& leaf : boost::get<leaf_set>(node->data))
+                {
+                    if (!leaf.value)
+                        continue;
+                    //d(c, o) lies within d(c, router) -/+ d(router, o) until it is worth computing
+                    R low = known ? std::abs(entry.parent_distance - leaf.distance) : 0;
+                    R high = known ? entry.parent_distance + leaf.distance : std::numeric_limits<R>::max();
+                    candidates.clear();
+                    for (size_t i = 0; i < n; i++)
+                    {
+                        if (false == active[i] || (exclude_self && queries[i] == &leaf) ||
+                            (low > center_distances[i] && low - center_distances[i] > dk[i]) ||
+                            (center_distances[i] > high && center_distances[i] - high > dk[i]))
+                            continue;
+                        candidates.push_back(i);
+                    }
+                    if (candidates.size() > 2)
+                    {
+                        low = high = d(center, *leaf.value);
+                    }
+                    for (size_t i : candidates)
+                    {
+                        if ((low > center_distances[i] && low - center_distances[i] > dk[i]) ||
+                            (center_distances[i] > high && center_distances[i] - high > dk[i]))
+                            continue;
+                        R distance = d(*queries[i]->value, *leaf.value);
+                        if (distance <= dk[i])
+                        {
+                            nn_entry object;
+                            object.id = leaf.id;
+                            object.distance = distance;
+                            nn_list_update(object, k, results[i]);
+                            dk[i] = nn_bound(results[i], k, std::numeric_limits<R>::max());
+                            if (results[i].size() == k && dk[i] < cutoff)
+                                active[i] = 0;
+                        }
+                    }
+                }
+            }
+        }
+    }
+
+    template < class T, size_t C, typename R, typename ID, typename V>
+    typename m_tree<T, C, R, ID, V>::knn_graph m_tree<T, C, R, ID, V>::make_knn_graph(std::vector<ID>& ids,
+        const std::vector<std::vector<nn_entry>>& rows) const
+    {
+        knn_graph graph;
+        graph.ids.swap(ids);
+        graph.offsets.reserve(rows.size() + 1);
+        graph.offsets.push_back(0);
+        for (const std::vector<nn_entry>& row : rows)
+        {
+            for (const nn_entry& entry : row)
+            {
+                graph.neighbours.push_back(entry.id);
+                graph.distances.push_back(entry.distance);
+            }
+            graph.offsets.push_back(graph.neighbours.size());
+        }
+        return graph;
+    }
+
+    template < class T, size_t C, typename R, typename ID, typename V>
+    std::vector<ID> m_tree<T, C, R, ID, V>::ring_query(const T& ref, R inner, R outer)
+    {
+        /*
+            Like range_query with a second test: a subtree is skipped when its whole ball lies inside the
+            inner radius. By the triangle inequality d(ref, o) <= d(ref, parent) + d(parent, o), which
+            lets subtrees and objects be discarded before their distance is computed. The root has no
+            parent so the upper bound only applies below it.
+            */
+        BOOST_ASSERT_MSG(inner <= outer, "ring_query: inner radius larger than outer radius");
+        std::vector<ID> result;
+        std::vector<std::pair<std::weak_ptr<tree_node>, R>> queue;
+        if (root)
+            queue.push_back(std::make_pair(std::weak_ptr<tree_node>(root), static_cast<R>(0)));
+        while (false == queue.empty())
+        {
+            if (auto locked = queue[0].first.lock())
+            {
+                R dist_to_parent = queue[0].second;
+                bool has_parent = locked != root;
+                if (locked->internal_node())
+                {
+                    route_set& ros = boost::get<route_set>(locked->data);
+                    for (size_t i = 0; i < C; i++)
+                    {
+                        if (const T* temp_lock = ros[i].value.get())
+                        {
+                            if (std::abs(dist_to_parent - ros[i].distance) > outer + ros[i].covering_radius)
+                                continue;
+                            if (has_parent && dist_to_parent + ros[i].distance + ros[i].covering_radius < inner)
+                                continue;
+                            R distance = d(ref, *temp_lock);
+                            if (distance <= outer + ros[i].covering_radius && distance + ros[i].covering_radius >= inner)
+                                queue.push_back(std::make_pair(std::weak_ptr<tree_node>(ros[i].covering_tree), distance));
+                        }
+                    }
+                }
+                else if (locked->leaf_node())
+                {
+                    leaf_set& los = boost::get<leaf_set>(locked->data);
+                    for (size_t i = 0; i < C; i++)
+                    {
+                        if (los[i].value)
+                        {
+                            if (std::abs(dist_to_parent - los[i].distance) > outer)
+                                continue;
+                            if (has_parent && dist_to_parent + los[i].distance < inner)
+                                continue;
+                            R distance = d(*los[i].value, ref);
+                            if (distance <= outer && distance >= inner)
+                                result.push_back(los[i].id);
+                        }
+                    }
+                }
+            }
+            queue.erase(std::begin(queue));
+        }
+        return result;
+    }
+
+    template < class T, size_t C, typename R, typename ID, typename V>
+    std::vector<std::pair<ID, R>> m_tree<T, C, R, ID, V>::farthest_query(const T& ref, size_t k) const
+    {
+        /*
+            Best first search on the upper bound d(ref, router) + covering radius, the node that could
+            hold the farthest object is expanded first. Once k objects are found anything whose upper bound
+            is below the k-th distance is discarded, d(ref, parent) + d(parent, entry) bounds the
+            distance before it is computed.
+            */
+        std::vector<std::pair<ID, R>> result;
+        if (!root || 0 == k)
+            return result;
+        auto farther = [](const std::pair<ID, R>& a, const std::pair<ID, R>& b)
+        {
+            return a.second > b.second;
+        };
+        auto bound = [&]()
+        {
+            return result.size() < k ? static_cast<R>(0) : result.back().second;
+        };
+        std::priority_queue<farthest_entry> queue;
+        farthest_entry root_entry;
+        root_entry.dmax = std::numeric_limits<R>::max();
+        root_entry.node = root;
+        queue.push(root_entry);
+        while (false == queue.empty())
+        {
+            farthest_entry entry = queue.top();
+            queue.pop();
+            if (result.size() == k && entry.dmax <= bound())
+                break;
+            auto locked = entry.node.lock();
+            if (!locked)
+                continue;
+            bool has_parent = locked != root;
+            if (locked->internal_node())
+            {
+                for (const routing_object& ro : boost::get<route_set>(locked->data))
+                {
+                    const T* value = ro.value.get();
+                    if (!value)
+                        continue;
+                    if (has_parent && result.size() == k &&
+                        entry.parent_distance + ro.distance + ro.covering_radius <= bound())
+                        continue;
+                    farthest_entry child;
+                    child.parent_distance = d(ref, *value);
+                    child.dmax = child.parent_distance + ro.covering_radius;
+                    child.node = ro.covering_tree;
+                    if (result.size() < k || child.dmax > bound())
+                        queue.push(child);
+                }
+            }
+            else if (locked->leaf_node())
+            {
+                for (const leaf_object& lo : boost::get<leaf_set>(locked->data))
+                {
+                    if (!lo.value)
+                        continue;
+                    if (has_parent && result.size() == k && entry.parent_distance + lo.distance <= bound())
+                        continue;
+                    std::pair<ID, R> object(lo.id, d(ref, *lo.value));
+                    if (result.size() < k || object.second > bound())
+                    {
+                        result.insert(std::upper_bound(std::begin(result), std::end(result), object, farther), object);
+                        if (result.size() > k)
+                            result.pop_back();
+                    }
+                }
+            }
+        }
+        return result;
+    }
+
+    template < class T, size_t C, typename R, typename ID, typename V>
+    std::vector<std::tuple<ID, ID, R>> m_tree<T, C, R, ID, V>::closest_pairs(const m_tree& other, size_t k) const
+    {
+        /*
+            Best first dual tree search. Pairs of subtrees are ordered by the lower bound
+            d(center_a, center_b) - radius_a - radius_b on the distance between their objects and expanded
+            with the join functions, using the k-th closest pair found so far as the join range.
+            */
+        typedef std::tuple<ID, ID, R> id_pair;
+        std::vector<id_pair> result;
+        if (!root || !other.root || 0 == k)
+            return result;
+        auto closer = [](const id_pair& a, const id_pair& b)
+        {
+            return std::get<2>(a) < std::get<2>(b);
+        };
+        auto bound = [&]()
+        {
+            return result.size() < k ? std::numeric_limits<R>::max() : std::get<2>(result.back());
+        };
+        pair_callback collect = [&](const ID& a, const ID& b, R distance)
+        {
+            if (result.size() == k && distance >= bound())
+                return;
+            id_pair found(a, b, distance);
+            result.insert(std::upper_bound(std::begin(result), std::end(result), found, closer), found);
+            if (result.size() > k)
+                result.pop_back();
+        };
+        auto lower_bound = [](const join_task& task)
+        {
+            if (!task.a.center || !task.b.center || task.self)
+                return static_cast<R>(0);
+            R gap = task.center_distance - task.a.radius - task.b.radius;
+            return gap > 0 ? gap : static_cast<R>(0);
+        };
+        typedef std::pair<R, join_task> ranked_task;
+        auto later = [](const ranked_task& a, const ranked_task& b)
+        {
+            return a.first > b.first;
+        };
+        std::priority_queue<ranked_task, std::vector<ranked_task>, decltype(later)> queue(later);
+        join_task start;
+        start.a.node = root;
+        start.b.node = other.root;
+        start.self = root == other.root;
+        queue.push(ranked_task(static_cast<R>(0), start));
+        std::vector<join_task> pending;
+        while (false == queue.empty() && queue.top().first <= bound())
+        {
+            join_task task = queue.top().second;
+            queue.pop();
+            join_step(task, bound(), collect, pending, join_filter());
+            for (const join_task& child : pending)
+            {
+                R lower = lower_bound(child);
+                if (lower <= bound())
+                    queue.push(ranked_task(lower, child));
+            }
+            pending.clear();
+        }
+        return result;
+    }
+
+    template < class T, size_t C, typename R, typename ID, typename V>
+    std::vector<std::pair<ID, R>> m_tree<T, C, R, ID, V>::complex_query(const std::vector<T>& refs, size_t k,
+        const scoring_function& score) const
+    {
+        /*
+            From "Processing Complex Similarity Queries with Distance-based Access Methods"
+            (P. Ciaccia, M. Patella, P. Zezula). As the scoring function is monotone, applying it to lower
+            bounds on the distances to each query object gives a lower bound on the score. Subtrees are
+            searched best first on that bound, first using |d(ref, parent) - d(parent, entry)| for every
+            query object, then replacing the bounds with real distances one at a time until the entry is
+            either discarded or fully known.
+            */
+        BOOST_ASSERT_MSG(false == refs.empty(), "complex_query: no query objects");
+        std::vector<std::pair<ID, R>> result;
+        if (!root || 0 == k)
+            return result;
+        auto closer = [](const std::pair<ID, R>& a, const std::pair<ID, R>& b)
+        {
+            return a.second < b.second;
+        };
+        auto bound = [&]()
+        {
+            return result.size() < k ? std::numeric_limits<R>::max() : result.back().second;
+        };
+        auto later = [](const complex_entry& a, const complex_entry& b)
+        {
+            return a.dmin > b.dmin;
+        };
+        std::priority_queue<complex_entry, std::vector<complex_entry>, decltype(later)> queue(later);
+        complex_entry root_entry;
+        root_entry.node = root;
+        queue.push(root_entry);
+        std::vector<R> distances(refs.size());
+        while (false == queue.empty() && queue.top().dmin <= bound())
+        {
+            complex_entry entry = queue.top();
+            queue.pop();
+            auto locked = entry.node.lock();
+            if (!locked)
+                continue;
+            bool has_parent = locked != root;
+            if (locked->internal_node())
+            {
+                for (const routing_object& ro : boost::get<route_set>(locked->data))
+                {
+                    const T* value = ro.value.get();
+                    if (!value)
+                        continue;
+                    for (size_t i = 0; i < refs.size(); i++)
+                    {
+                        distances[i] = has_parent ? std::abs(entry.parent_distances[i] - ro.distance) : static_cast<R>(0);
+                    }
+                    complex_entry child;
+                    if (complex_score(refs, score, *value, distances, ro.covering_radius, bound(), child.dmin))
+                    {
+                        child.parent_distances = distances;
+                        child.node = ro.covering_tree;
+                        queue.push(child);
+                    }
+                }
+            }
+            else if (locked->leaf_node())
+            {
+                for (const leaf_object& lo : boost::get<leaf_set>(locked->data))
+                {
+                    if (!lo.value)
+                        continue;
+                    for (size_t i = 0; i < refs.size(); i++)
+                    {
+                        distances[i] = has_parent ? std::abs(entry.parent_distances[i] - lo.distance) : static_cast<R>(0);
+                    }
+                    std::pair<ID, R> object(lo.id, static_cast<R>(0));
+                    if (complex_score(refs, score, *lo.value, distances, static_cast<R>(0), bound(), object.second) &&
+                        (result.size() < k || object.second < bound()))
+                    {
+                        result.insert(std::upper_bound(std::begin(result), std::end(result), object, closer), object);
+                        if (result.size() > k)
+                            result.pop_back();
+                    }
+                }
+            }
+        }
+        return result;
+    }
+
+    template < class T, size_t C, typename R, typename ID, typename V>
+    bool m_tree<T, C, R, ID, V>::complex_score(const std::vector<T>& refs, const scoring_function& score, const T& value,
+        std::vector<R>& distances, R radius, R threshold, R& result) const
+    {
+        /*
+            distances holds lower bounds on d(ref, value) on entry and the real distances on a true return.
+            The score of the ball of the given radius around value is bounded with max(d - radius, 0).
+            */
+        std::vector<R> lower(distances.size());
+        auto ball_score = [&]()
+        {
+            for (size_t i = 0; i < distances.size(); i++)
+            {
+                lower[i] = distances[i] > radius ? distances[i] - radius : static_cast<R>(0);
+            }
+            return score(lower);
+        };
+        if (ball_score() > threshold)
+            return false;
+        for (size_t i = 0; i < refs.size(); i++)
+        {
+            distances[i] = d(refs[i], value);
+            result = ball_score();
+            if (result > threshold)
+                return false;
+        }
+        return true;
+    }
+
+    template < class T, size_t C, typename R, typename ID, typename V>
+    typename m_tree<T, C, R, ID, V>::scoring_function m_tree<T, C, R, ID, V>::min_score()
+    {
+        return [](const std::vector<R>& distances)
+        {
+            return *std::min_element(std::begin(distances), std::end(distances));
+        };
+    }
+
+    template < class T, size_t C, typename R, typename ID, typename V>
+    typename m_tree<T, C, R, ID, V>::scoring_function m_tree<T, C, R, ID, V>::max_score()
+    {
+        return [](const std::vector<R>& distances)
+        {
+            return *std::max_element(std::begin(distances), std::end(distances));
+        };
+    }
+
+    template < class T, size_t C, typename R, typename ID, typename V>
+    typename m_tree<T, C, R, ID, V>::scoring_function m_tree<T, C, R, ID, V>::weighted_sum(const std::vector<R>& weights)
+    {
+        BOOST_ASSERT_MSG(std::none_of(std::begin(weights), std::end(weights), [](R w){ return w < 0; }),
+            "weighted_sum: negative weights are not monotone");
+        return [weights](const std::vector<R>& distances)
+        {
+            BOOST_ASSERT_MSG(weights.size() == distances.size(), "weighted_sum: one weight per query object needed");
+            R total = static_cast<R>(0);
+            for (size_t i = 0; i < distances.size(); i++)
+            {
+                total += weights[i] * distances[i];
+            }
+            return total;
+        };
+    }
+
+    template < class T, size_t C, typename R, typename ID, typename V>
+    std::vector<std::pair<ID, R>> m_tree<T, C, R, ID, V>::knn_query(const T& ref, size_t k)
+    {
+        return knn_query(ref, k, knn_approximation());
+    }
+
+    template < class T, size_t C, typename R, typename ID, typename V>
+    std::vector<std::pair<ID, R>> m_tree<T, C, R, ID, V>::knn_query(const T& ref, size_t k, const id_filter& filter)
+    {
+        bool exact = false;
+        return knn_search(ref, k, std::numeric_limits<R>::max(), knn_approximation(), query_budget(), filter,
+            time_point::min(), exact, d);
+    }
+
+    template < class T, size_t C, typename R, typename ID, typename V>
+    std::vector<std::pair<ID, R>> m_tree<T, C, R, ID, V>::knn_range_query(const T& ref, size_t k, R range)
+    {
+        bool exact = false;
+        return knn_search(ref, k, range, knn_approximation(), query_budget(), id_filter(), time_point::min(), exact, d);
+    }
+
+    template < class T, size_t C, typename R, typename ID, typename V>
+    std::vector<std::pair<ID, R>> m_tree<T, C, R, ID, V>::knn_query(const T& ref, size_t k, const knn_approximation& approx)
+    {
+        bool exact = false;
+        return knn_query(ref, k, approx, query_budget(), exact);
+    }
+
+    template < class T, size_t C, typename R, typename ID, typename V>
+    std::vector<std::pair<ID, R>> m_tree<T, C, R, ID, V>::knn_query(const T& ref, size_t k, const query_budget& budget, bool& exact)
+    {
+        return knn_query(ref, k, knn_approximation(), budget, exact);
+    }
+
+    template < class T, size_t C, typename R, typename ID, typename V>
+    std::vector<std::pair<ID, R>> m_tree<T, C, R, ID, V>::knn_query(const T& ref, size_t k, const knn_approximation& approx,
+        const query_budget& budget, bool& exact)
+    {
+        return knn_search(ref, k, std::numeric_limits<R>::max(), approx, budget, id_filter(), time_point::min(), exact, d);
+    }
+
+    template < class T, size_t C, typename R, typename ID, typename V>
+    template <class Q>
+    std::vector<std::pair<ID, R>> m_tree<T, C, R, ID, V>::knn_search(const Q& ref, size_t k, R range, const knn_approximation& approx,
+        const query_budget& budget, const id_filter& filter, time_point since, bool& exact,
+        const std::function<R(const Q&, const T&)>& query_distance) const
+    {
+        BOOST_ASSERT_MSG(k > 0, "knn_query: 0 neighbours is invalid");
+        BOOST_ASSERT_MSG(approx.epsilon >= 0.0, "knn_query: epsilon must be positive");
+        BOOST_ASSERT_MSG(approx.delta == 0.0 || false == distance_distribution.empty(),
+            "knn_query: PAC queries need estimate_distance_distribution to be called first");
+        //ties, common when the query lies inside many covering radii, go to the closest routing object
+        //which gets an anytime search to the leaves sooner
+        auto choose_node = [](const knn_entry& a, const knn_entry& b)
+        {
+            return a.dmin < b.dmin || (a.dmin == b.dmin && a.parent_distance < b.parent_distance);
+        };
+        auto placeholder = [](const nn_entry& a)
+        {
+            return nullptr != a.subtree;
+        };
+        std::vector<nn_entry> result;
+        std::vector<knn_entry> queue;
+        if (root)
+        {
+            knn_entry root_entry;
+            root_entry.node = root;
+            queue.push_back(root_entry);
+        }
+        //PAC stopping radius, once the k-th neighbour is this close a better one is unlikely to exist
+        R stop_radius = static_cast<R>(0);
+        if (approx.delta > 0.0 && false == distance_distribution.empty())
+            stop_radius = pac_radius(approx.delta, k);
+        bool timed = budget.deadline != std::chrono::steady_clock::time_point::max();
+        size_t distances = 0, nodes = 0;
+        /*
+            dmax placeholders hold result slots until their subtree is expanded, the objects they displace are
+            dropped. A budgeted search may stop first so it keeps the best objects seen apart and returns those
+            */
+        bool budgeted = budget.max_distances > 0 || budget.max_nodes > 0 || timed;
+        std::vector<nn_entry> seen;
+        //only a search that runs out of candidate nodes without relaxing any bound is provably exact
+        exact = approx.epsilon <= 0.0;
+
+        while (false == queue.empty())
+        {
+            auto current = std::min_element(std::begin(queue), std::end(queue), choose_node);
+            //best first order, every remaining node is too far away to improve the result
+            if (current->dmin > relax_bound(nn_bound(result, k, range), approx.epsilon))
+                break;
+            if ((budget.max_distances > 0 && distances >= budget.max_distances) ||
+                (budget.max_nodes > 0 && nodes >= budget.max_nodes) ||
+                (timed && std::chrono::steady_clock::now() >= budget.deadline))
+            {
+                exact = false;
+                break;
+            }
+            knn_entry entry = *current;
+            queue.erase(current);
+            knn_node_search(ref, entry, k, range, approx.epsilon, filter, since, queue, result, budgeted ? &seen : nullptr,
+                distances, query_distance);
+            nodes++;
+
+            if (approx.delta > 0.0 && result.size() == k && result.back().distance <= (1.0 + approx.epsilon) * stop_radius &&
+                std::none_of(std::begin(result), std::end(result), placeholder))
+            {
+                exact = false;
+                break;
+            }
+        }
+        std::vector<std::pair<ID, R>> neighbours;
+        for (const nn_entry& entry : budgeted ? seen : result)
+        {
+            if (false == placeholder(entry))
+                neighbours.push_back(std::make_pair(entry.id, entry.distance));
+        }
+        return neighbours;
+    }
+
+    template < class T, size_t C, typename R, typename ID, typename V>
+    R m_tree<T, C, R, ID, V>::relax_bound(R dk, double epsilon) const
+    {
+        if (epsilon <= 0.0 || dk == std::numeric_limits<R>::max())
+            return dk;
+        return static_cast<R>(dk / (1.0 + epsilon));
+    }
+
+    template < class T, size_t C, typename R, typename ID, typename V>
+    R m_tree<T, C, R, ID, V>::pac_radius(double delta, size_t k) const
+    {
+        /*
+            G(x) = 1 - (1 - F(x))^n is the distribution of the nearest neighbour distance for n objects
+            given the distance distribution F. The radius returned is G^-1(delta), the k-th neighbour is
+            approximated by the nearest neighbour of a dataset k times smaller.
+        */
+        double n = std::max(1.0, static_cast<double>(tree_size) / static_cast<double>(k));
+        double quantile = 1.0 - std::pow(1.0 - std::min(delta, 1.0), 1.0 / n);
+        size_t index = static_cast<size_t>(quantile * static_cast<double>(distance_distribution.size()));
+        index = std::min(index, distance_distribution.size() - 1);
+        return distance_distribution[index];
+    }
+
+    template < class T, size_t C, typename R, typename ID, typename V>
+    void m_tree<T, C, R, ID, V>::estimate_distance_distribution(size_t samples)
+    {
+        distance_distribution.clear();
+        std::vector<const T*> objects;
+        collect_objects(objects);
+        if (objects.size() < 2)
+            return;
+        std::default_random_engine generator;
+        std::uniform_int_distribution<size_t> distribution(0, objects.size() - 1);
+        distance_distribution.reserve(samples);
+        for (size_t i = 0; i < samples; i++)
+        {
+            size_t a = distribution(generator);
+            size_t b = distribution(generator);
+            while (a == b)
+            {
+                b = distribution(generator);
+            }
+            distance_distribution.push_back(d(*objects[a], *objects[b]));
+        }
+        std::sort(std::begin(distance_distribution), std::end(distance_distribution));
+    }
+
+    template < class T, size_t C, typename R, typename ID, typename V>
+    void m_tree<T, C, R, ID, V>::collect_leaves(std::shared_ptr<tree_node> node, std::vector<std::shared_ptr<tree_node>>& leaves) const
+    {
+        std::vector<std::weak_ptr<tree_node>> queue;
+        if (node)
+            queue.push_back(node);
+        while (false == queue.empty())
+        {
+            std::shared_ptr<tree_node> current = queue.back().lock();
+            queue.pop_back();
+            if (!current)
+                continue;
+            if (current->internal_node())
+            {
+                get_subtrees getter(queue);
+                boost::apply_visitor(getter, current->data);
+            }
+            else if (current->leaf_node())
+            {
+                leaves.push_back(current);
+            }
+        }
+    }
+
+    template < class T, size_t C, typename R, typename ID, typename V>
+    void m_tree<T, C, R, ID, V>::collect_objects(std::vector<const T*>& objects) const
+    {
+        std::vector<std::weak_ptr<tree_node>> queue;
+        if (root)
+            queue.push_back(root);
+        while (false == queue.empty())
+        {
+            std::shared_ptr<tree_node> current = queue.back().lock();
+            queue.pop_back();
+            if (!current)
+                continue;
+            if (current->internal_node())
+            {
+                get_subtrees getter(queue);
+                boost::apply_visitor(getter, current->data);
+            }
+            else if (current->leaf_node())
+            {
+                for (const leaf_object& leaf : boost::get<leaf_set>(current->data))
+                {
+                    if (leaf.value)
+                        objects.push_back(leaf.value.get());
+                }
+            }
+        }
+    }
+
+    template < class T, size_t C, typename R, typename ID, typename V>
+    void m_tree<T, C, R, ID, V>::nn_list_update(const nn_entry& in, size_t k, std::vector<nn_entry>& result) const
+    {
+        auto sort_result = [](const nn_entry& a, const nn_entry& b)
+        {
+            return a.distance < b.distance;
+        };
+        result.insert(std::upper_bound(std::begin(result), std::end(result), in, sort_result), in);
+
+        if(result.size()>k)
+        {
+            result.erase(std::begin(result) + k, std::end(result));
+        }       
+    }
+
+    template < class T, size_t C, typename R, typename ID, typename V>
+    R m_tree<T, C, R, ID, V>::nn_bound(const std::vector<nn_entry>& result, size_t k, R range) const
+    {
+        //dk starts at the query range so it prunes before k candidates are known
+        if (result.size() < k)
+            return range;
+        return std::min(result.back().distance, range);
+    }
+
+    template < class T, size_t C, typename R, typename ID, typename V>
+    template <class Q>
+    void m_tree<T, C, R, ID, V>::knn_node_search(const Q& ref, const knn_entry& current, size_t k, R range, double epsilon,
+        const id_filter& filter, time_point since, std::vector<knn_entry>& queue, std::vector<nn_entry>& result,
+        std::vector<nn_entry>* seen, size_t& distances, const std::function<R(const Q&, const T&)>& query_distance) const
+    {
+        using namespace std::placeholders;
+        std::shared_ptr<tree_node> node = current.node.lock();
+        if (!node)
+            return;
+
+        auto remove_node = [](const knn_entry& a, R threshold)
+        {
+            return a.dmin > threshold;
+        };
+        auto expanded = [](const nn_entry& a, const tree_node* n)
+        {
+            return a.subtree == n;
+        };
+        //the node's dmax placeholder is replaced by its contents
+        result.erase(std::remove_if(std::begin(result), std::end(result), std::bind(expanded, _1, node.get())),
+            std::end(result));
+
+        R dp = current.parent_distance;
+        R dk = nn_bound(result, k, range);
+        R bound = relax_bound(dk, epsilon);
+
+        if (node->internal_node())
+        {
+            route_set& set = boost::get<route_set>(node->data);
+            for (const routing_object& ro : set)
+            {
+                if ((ro.value) && ro.newest >= since &&
+                    (std::abs(dp - ro.distance) <= bound + ro.covering_radius))
+                {
+                    R value_distance = query_distance(ref, *ro.value);
+                    distances++;
+                    R dmin = std::max(value_distance - ro.covering_radius, static_cast<R>(0));
+                    
+                    if (dmin <= bound)
+                    {
+                        knn_entry child;
+                        child.dmin = dmin;
+                        child.parent_distance = value_distance;
+                        child.node = ro.covering_tree;
+                        queue.push_back(child);
+                        //with a filter a subtree may hold no qualifying object so dmax bounds nothing. A relaxed
+                        //search may prune the subtree or stop before expanding it, its slot would then be lost
+                        R dmax = value_distance + ro.covering_radius;
+                        if (!filter && since == time_point::min() && epsilon <= 0.0 && dmax < dk)
+                        {
+                            nn_entry queue_value;
+                            queue_value.distance = dmax;
+                            queue_value.subtree = ro.covering_tree.get();
+                            nn_list_update(queue_value, k, result);
+                            dk = nn_bound(result, k, range);
+                            bound = relax_bound(dk, epsilon);
+                            queue.erase(std::remove_if(std::begin(queue), std::end(queue), std::bind(remove_node, _1, bound)),
+                                std::end(queue));
+                        }
+                    }
+                }
+            }
+        }
+        else if (node->leaf_node())
+        {
+            leaf_set& set = boost::get<leaf_set>(node->data);
+            for (const leaf_object& leaf : set)
+            {
+                if (leaf.value && leaf.timestamp >= since && (!filter || filter(leaf.id)) && std::abs(dp - leaf.distance) <= dk)
+                {
+                    R value_distance = query_distance(ref, *leaf.value);
+                    distances++;
+                    nn_entry object;
+                    object.id = leaf.id;
+                    object.distance = value_distance;
+                    if (seen)
+                        nn_list_update(object, k, *seen);
+                    if (value_distance <= dk)
+                    {
+                        nn_list_update(object, k, result);
+                        dk = nn_bound(result, k, range);
+                        bound = relax_bound(dk, epsilon);
+                        queue.erase(std::remove_if(std::begin(queue), std::end(queue), std::bind(remove_node, _1, bound)),
+                            std::end(queue));
+                    }
+                }
+            }
+        }
+    }
+
+
+    template < class T, size_t C, typename R, typename ID, typename V>
+    typename m_tree<T, C, R, ID, V>::nn_browser m_tree<T, C, R, ID, V>::browse(const T& ref) const
+    {
+        return nn_browser(*this, ref);
+    }
+
+    template < class T, size_t C, typename R, typename ID, typename V>
+    m_tree<T, C, R, ID, V>::nn_browser::nn_browser(const m_tree& t, const T& r) :
+        tree(&t),
+        ref(r)
+    {
+        if (tree->root)
+        {
+            browse_entry root_entry;
+            root_entry.node = tree->root;
+            root_entry.exact = true;
+            queue.push(root_entry);
+        }
+    }
+
+    template < class T, size_t C, typename R, typename ID, typename V>
+    bool m_tree<T, C, R, ID, V>::nn_browser::empty() const
+    {
+        return queue.empty();
+    }
+
+    template < class T, size_t C, typename R, typename ID, typename V>
+    bool m_tree<T, C, R, ID, V>::nn_browser::next(std::pair<ID, R>& result)
+    {
+        while (false == queue.empty())
+        {
+            browse_entry entry = queue.top();
+            queue.pop();
+            if (entry.object && entry.exact)
+            {
+                result = std::make_pair(entry.object->id, entry.key);
+                return true;
+            }
+            expand(entry);
+        }
+        return false;
+    }
+
+    template < class T, size_t C, typename R, typename ID, typename V>
+    void m_tree<T, C, R, ID, V>::nn_browser::expand(const browse_entry& entry)
+    {
+        if (false == entry.exact)
+        {
+            //the bound reached the front, requeue with the real distance
+            browse_entry exact = entry;
+            exact.exact = true;
+            if (entry.object)
+            {
+                exact.key = tree->d(*entry.object->value, ref);
+            }
+            else if (const T* value = entry.router->value.get())
+            {
+                exact.parent_distance = tree->d(*value, ref);
+                exact.key = std::max(exact.parent_distance - entry.router->covering_radius, static_cast<R>(0));
+            }
+            queue.push(exact);
+            return;
+        }
+        std::shared_ptr<tree_node> node = entry.node.lock();
+        if (!node)
+            return;
+        if (node->internal_node())
+        {
+            for (const routing_object& ro : boost::get<route_set>(node->data))
+            {
+                if (ro.value)
+                {
+                    browse_entry child;
+                    child.key = std::max(std::abs(entry.parent_distance - ro.distance) - ro.covering_radius, static_cast<R>(0));
+                    child.node = ro.covering_tree;
+                    child.router = &ro;
+                    queue.push(child);
+                }
+            }
+        }
+        else if (node->leaf_node())
+        {
+            for (const leaf_object& leaf : boost::get<leaf_set>(node->data))
+            {
+                if (leaf.value)
+                {
+                    browse_entry object;
+                    object.key = std::abs(entry.parent_distance - leaf.distance);
+                    object.object = &leaf;
+                    queue.push(object);
+                }
+            }
+        }
+    }
 
-    template < class T, size_t C, typename R, typename ID>
-    void m_tree<T, C, R, ID>::print(print_level level = SPARSE, std::weak_ptr<tree_node> print_node = std::weak_ptr<tree_node>())
+    template < class T, size_t C, typename R, typename ID, typename V>
+    void m_tree<T, C, R, ID, V>::print(print_level level = SPARSE, std::weak_ptr<tree_node> print_node = std::weak_ptr<tree_node>())
     {
         std::vector<std::weak_ptr<tree_node>> queue;
         if (print_node.lock())
@@ -1267,7 +4273,7 @@ namespace mt
                 {
                     if (i > 0)
                         std::cout << ", ";
-                    if (auto lock = ro_array[i].value.lock())
+                    if (const T* lock = ro_array[i].value.get())
                     {
                         std::cout << *lock;
                         if (!level)